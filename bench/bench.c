@@ -0,0 +1,254 @@
+/*
+ * bench.c - measures the CPU side of fl.h, recording, culling, sorting,
+ * batching and writing the glyph data, with the null backend.
+ * No OpenGL or window is needed.
+ *
+ * Every combination of texture count, sprite count and sort mode draws
+ * the same random sprites for a number of frames. The fastest frame is
+ * reported as sprites per second and nanoseconds per sprite, along with
+ * the batches and the sort and expand time of that frame.
+ *
+ * Usage:
+ * -----------------------------------------------------------------------------
+ * make -C bench run                        // print the results
+ * ./bench/bench > baseline.txt             // keep them as a baseline
+ * ./bench/bench baseline.txt [tolerance]   // compare against the baseline
+ * -----------------------------------------------------------------------------
+ * When comparing, a line is marked SLOWER when its ns/sprite is more than
+ * tolerance percent, 10 by default, above the baseline and the program
+ * exits with 1 if any was.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* clock_gettime */
+#include <time.h>
+
+#define FL_HEADLESS
+#define FL_IMPLEMENTATION
+#include "../fl.h"
+
+#define BENCH_WIDTH 1920.0f
+#define BENCH_HEIGHT 1080.0f
+
+/*
+ * How many sprites go through the renderer for each combination,
+ * split over at least BENCH_MIN_FRAMES frames
+ */
+#define BENCH_SPRITES_PER_RUN 4000000
+#define BENCH_MIN_FRAMES 8
+#define BENCH_WARMUP_FRAMES 2
+
+static const int benchTextures[] = { 1, 16, 256 };
+static const int benchSprites[] = { 1000, 10000, 100000 };
+static const char *benchSortNames[] = {
+    "none", "texture", "layer", "front2back", "back2front"
+};
+
+#define BENCH_COUNT(a) (int)(sizeof(a) / sizeof((a)[0]))
+
+typedef struct benchSprite {
+    GLuint texture;
+    flVec4_t dest;
+    flVec4_t src;
+    GLuint color;
+    int layer;
+    float depth;
+} benchSprite_t;
+
+typedef struct benchResult {
+    int textures;
+    int sprites;
+    char sort[16];
+    double nsPerSprite;
+} benchResult_t;
+
+static unsigned int benchSeed = 1;
+
+static unsigned int bench_random()
+{
+    /* xorshift, the same sprites on every run and platform */
+    benchSeed ^= benchSeed << 13;
+    benchSeed ^= benchSeed >> 17;
+    benchSeed ^= benchSeed << 5;
+    return benchSeed;
+}
+
+static float bench_random_float(float max)
+{
+    return (float)(bench_random() & 0xFFFF) / 65536.0f * max;
+}
+
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void bench_fill(benchSprite_t *sprites, int count, int textures)
+{
+    int i;
+    benchSeed = 1;
+    for (i = 0; i < count; i++) {
+        benchSprite_t *s = &sprites[i];
+        s->texture = 1 + bench_random() % textures;
+        s->dest.x = bench_random_float(BENCH_WIDTH - 32.0f);
+        s->dest.y = bench_random_float(BENCH_HEIGHT - 32.0f);
+        s->dest.z = 32.0f;
+        s->dest.w = 32.0f;
+        s->src = (flVec4_t){ 0.0f, 0.0f, 1.0f, 1.0f };
+        s->color = 0xFF000000 | bench_random();
+        s->layer = bench_random() % 8;
+        s->depth = bench_random_float(1.0f);
+    }
+}
+
+/*
+ * Draws the sprites for a number of frames.
+ * Returns the time of the fastest frame, its stats are stored in best.
+ */
+static double bench_run(const benchSprite_t *sprites, int count,
+        flSortMode_t sortMode, flRendererStats_t *best)
+{
+    int frames = BENCH_SPRITES_PER_RUN / count;
+    double bestTime = -1.0;
+    int frame, i;
+
+    if (frames < BENCH_MIN_FRAMES) frames = BENCH_MIN_FRAMES;
+
+    for (frame = -BENCH_WARMUP_FRAMES; frame < frames; frame++) {
+        flRendererStats_t stats;
+        double start = bench_now(), time;
+
+        flRendererBeginWithSortMode(sortMode);
+        for (i = 0; i < count; i++) {
+            const benchSprite_t *s = &sprites[i];
+            flRendererDrawLayered(s->texture, s->dest, s->src, s->color,
+                s->layer, s->depth);
+        }
+        flRendererEnd();
+
+        time = bench_now() - start;
+        flRendererGetStats(&stats);
+        if (frame >= 0 && (bestTime < 0.0 || time < bestTime)) {
+            bestTime = time;
+            *best = stats;
+        }
+    }
+    return bestTime;
+}
+
+/*
+ * Reads the results a previous run printed
+ */
+static int bench_load(const char *path, benchResult_t *results, int max)
+{
+    char line[256];
+    int count = 0;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        printf("Could not open the baseline %s\n", path);
+        return -1;
+    }
+    while (count < max && fgets(line, sizeof(line), file) != NULL) {
+        benchResult_t *r = &results[count];
+        double spritesPerSecond;
+        if (sscanf(line, "%d %d %15s %lf %lf", &r->textures, &r->sprites,
+                r->sort, &spritesPerSecond, &r->nsPerSprite) == 5)
+            count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static const benchResult_t *bench_find(const benchResult_t *results,
+        int count, int textures, int sprites, const char *sort)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        if (results[i].textures == textures && results[i].sprites == sprites
+                && strcmp(results[i].sort, sort) == 0)
+            return &results[i];
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    benchResult_t baseline[256];
+    int baselineCount = 0;
+    double tolerance = 10.0;
+    int slower = 0;
+    int maxSprites = benchSprites[BENCH_COUNT(benchSprites) - 1];
+    flRendererRecording_t recording = { 0 };
+    flRendererBackend_t backend;
+    flRendererConfig_t config = { 0 };
+    benchSprite_t *sprites;
+    flMat4_t projection;
+    int t, n, m;
+
+    if (argc > 1) {
+        baselineCount = bench_load(argv[1], baseline, BENCH_COUNT(baseline));
+        if (baselineCount < 0) return 1;
+    }
+    if (argc > 2) tolerance = atof(argv[2]);
+
+    sprites = (benchSprite_t *)malloc(sizeof(benchSprite_t) * maxSprites);
+    if (sprites == NULL) return 1;
+
+    flRendererNullBackend(&recording, &backend);
+    flRendererSetBackend(&backend);
+
+    /* Room for the biggest frame up front, no flushes in the middle */
+    config.maxGlyphs = maxSprites;
+    config.growable = true;
+    config.streamingFrames = FL_RENDERER_STREAMING_FRAMES;
+    config.textureUnits = FL_RENDERER_MAX_TEXTURE_UNITS;
+    flRendererInitWithConfig(&config);
+
+    flMat4Ortho(0.0f, BENCH_WIDTH, BENCH_HEIGHT, 0.0f, -1.0f, 1.0f,
+        &projection);
+    flRendererSetProjectionMatrix(&projection);
+
+    printf("# textures sprites sort sprites/sec ns/sprite batches "
+        "sort_ms expand_ms\n");
+    for (t = 0; t < BENCH_COUNT(benchTextures); t++) {
+        for (n = 0; n < BENCH_COUNT(benchSprites); n++) {
+            bench_fill(sprites, benchSprites[n], benchTextures[t]);
+            for (m = 0; m < BENCH_COUNT(benchSortNames); m++) {
+                flRendererStats_t stats;
+                const benchResult_t *base;
+                double time = bench_run(sprites, benchSprites[n],
+                    (flSortMode_t)m, &stats);
+                double ns = time * 1e9 / benchSprites[n];
+
+                printf("%d %d %s %.0f %.2f %d %.3f %.3f", benchTextures[t],
+                    benchSprites[n], benchSortNames[m], 1e9 / ns, ns,
+                    stats.batches, stats.sortTime * 1e3,
+                    stats.expandTime * 1e3);
+
+                base = bench_find(baseline, baselineCount, benchTextures[t],
+                    benchSprites[n], benchSortNames[m]);
+                if (base != NULL) {
+                    double change = (ns / base->nsPerSprite - 1.0) * 100.0;
+                    printf(" %+.1f%%", change);
+                    if (change > tolerance) {
+                        printf(" SLOWER");
+                        slower++;
+                    }
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    flRendererDestroy();
+    free(sprites);
+
+    if (slower > 0) {
+        printf("# %d of the results are more than %.1f%% slower\n",
+            slower, tolerance);
+        return 1;
+    }
+    return 0;
+}
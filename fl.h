@@ -47,11 +47,50 @@
  *
  * flRendererDestroy();
  * -----------------------------------------------------------------------------
+ *
+ * Measuring without a GPU:
+ * -----------------------------------------------------------------------------
+ * // Define FL_HEADLESS before including to build without OpenGL at all
+ * flRendererRecording_t recording = { 0 };
+ * flRendererBackend_t backend;
+ * flRendererNullBackend(&recording, &backend);
+ * flRendererSetBackend(&backend);
+ * flRendererInit();
+ *
+ * // time the frames as usual, recording holds what would have been drawn
+ * -----------------------------------------------------------------------------
+ *
+ * Pipelined frames:
+ * -----------------------------------------------------------------------------
+ * // config.pipelined = true, then on the game thread
+ * flRendererBegin();
+ * // ... draw
+ * flRendererEnd(); // hands the frame over and returns
+ *
+ * // and on the thread that owns the OpenGL context
+ * glClear(GL_COLOR_BUFFER_BIT);
+ * flRendererSubmit(); // sorts, batches and draws the frame handed over
+ * // swap the window buffers
+ * -----------------------------------------------------------------------------
  */
 
 #ifndef __FL_H__
 #define __FL_H__
 
+/*
+ * clock_gettime, pthreads and the mmap of flstd.h are POSIX, not ISO C.
+ * Make -std=c99/c11 expose them, as long as this is included first.
+ */
+#if (defined(FL_IMPLEMENTATION) || defined(FLSTD_IMPLEMENTATION)) && \
+    !defined(_WIN32)
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
 #ifdef	__cplusplus
 #define FL_BEGIN_DECLS extern "C" {
 #define FL_END_DECLS }
@@ -60,11 +99,14 @@
 #define FL_END_DECLS
 #endif
 
+/* Shared with flstd.h, whichever is included first defines it */
+#ifndef FLAPI
 #ifdef FL_STATIC
 #define FLAPI static
 #else
 #define FLAPI
 #endif
+#endif
 
 #ifndef __cplusplus
 #define bool char
@@ -73,11 +115,12 @@
 #endif
 
 #ifndef NDEBUG
-#define FLASSERT(x) (x) ?: printf("Assertion failed! %s >> %s:%d \n", #x, __FILE__, __LINE__)
+#define FLASSERT(x) ((x) ? (void)0 : (void)printf("Assertion failed! %s >> %s:%d \n", \
+    #x, __FILE__, __LINE__))
 #define FLOG(x) printf("[INFO]: %s \n", #x)
 #else
-#define FLASSERT(x) ((void*)0)
-#define FLOG(x) ((void*)0)
+#define FLASSERT(x) ((void)0)
+#define FLOG(x) ((void)0)
 #endif
 
 FL_BEGIN_DECLS
@@ -85,7 +128,20 @@ FL_BEGIN_DECLS
 #include <stdio.h> /* printf */
 #include <stdlib.h> /* malloc, free */
 #include <string.h> /* memset */
+#ifndef FL_HEADLESS
 #include <GL/glew.h> /* all the opengl stuff */
+#else
+/*
+ * No OpenGL, only the handful of its types the renderer uses
+ */
+#include <stdint.h> /* uint64_t */
+typedef unsigned int GLuint;
+typedef int GLint;
+typedef short GLshort;
+typedef unsigned short GLushort;
+typedef unsigned int GLenum;
+typedef uint64_t GLuint64;
+#endif
 
 typedef struct flVec2 {
     float x;
@@ -128,6 +184,59 @@ FLAPI void flMat4Identity(flMat4_t *out);
 FLAPI void flMat4Ortho(float left, float right, float bottom, float top,
         float near, float far, flMat4_t *out);
 
+/**
+ * Multiply two matrices. Transforming by the result is the same as
+ * transforming by b and then by a.
+ * @param a: the left matrix
+ * @param b: the right matrix
+ * @param out: the matrix to store the result. It can be a or b.
+ */
+FLAPI void flMat4Multiply(const flMat4_t *a, const flMat4_t *b, flMat4_t *out);
+
+/**
+ * Invert a matrix.
+ * @param m: the matrix to invert
+ * @param out: the matrix to store the result. It can be m.
+ * @return 0 on success, -1 when m can not be inverted. out is not touched then.
+ */
+FLAPI bool flMat4Inverse(const flMat4_t *m, flMat4_t *out);
+
+/**
+ * Transform points on the z = 0 plane, as (x, y, 0, 1), by a matrix
+ * and keep their x and y. There is no perspective divide.
+ * @param m: the matrix to transform by
+ * @param in: the points to transform
+ * @param out: where to store them. It can be in.
+ * @param count: how many points there are
+ */
+FLAPI void flMat4TransformVec2(const flMat4_t *m, const flVec2_t *in,
+        flVec2_t *out, int count);
+
+/**
+ * Transform vectors by a matrix.
+ * @param m: the matrix to transform by
+ * @param in: the vectors to transform
+ * @param out: where to store them. It can be in.
+ * @param count: how many vectors there are
+ */
+FLAPI void flMat4TransformVec4(const flMat4_t *m, const flVec4_t *in,
+        flVec4_t *out, int count);
+
+/**
+ * Create a 2D transform the way flRendererDrawTransformed places a
+ * rectangle: scaled and rotated around origin, with origin ending up
+ * at position. Compose them with flMat4Multiply.
+ * @param position: where origin ends up
+ * @param origin: the point everything is scaled and rotated around
+ * @param rotation: the rotation in radians, clockwise with y going down
+ * @param scale: the scale along x and y
+ * @param out: the matrix to store the result.
+ */
+FLAPI void flMat4Transform2D(flVec2_t position, flVec2_t origin,
+        float rotation, flVec2_t scale, flMat4_t *out);
+
+#ifndef FL_HEADLESS
+
 /**
  * Attach a shader to the program.
  * @param program: the program id generated with glCreateProgram.
@@ -144,26 +253,390 @@ FLAPI bool flShaderAttach(GLuint program, const char *src, GLenum shaderType);
  */
 FLAPI bool flShaderLink(GLuint program);
 
+#endif /* FL_HEADLESS */
+
+#ifndef FL_RENDERER_MAX_GLYPHS
+#define FL_RENDERER_MAX_GLYPHS 1000
+#endif
+
+#ifndef FL_RENDERER_STREAMING_FRAMES
+#define FL_RENDERER_STREAMING_FRAMES 3
+#endif
+#define FL_RENDERER_MAX_STREAMING_FRAMES 8
+
+/*
+ * The fragment shader samples from an array of this many textures.
+ * OpenGL 3.2 guarantees at least 16 texture image units.
+ */
+#define FL_RENDERER_MAX_TEXTURE_UNITS 16
+
+/*
+ * The GPU timer queries of this many frames are kept in flight.
+ * A result is read back this many frames after it was recorded.
+ */
+#ifndef FL_RENDERER_GPU_TIMER_FRAMES
+#define FL_RENDERER_GPU_TIMER_FRAMES 4
+#endif
+
+/*
+ * The glyph corners are built with SSE2 when the compiler targets it,
+ * the matrix functions use SSE2 or NEON.
+ * Define FL_NO_SIMD before including this file to always use the scalar code.
+ */
+
+/*
+ * Renderer settings passed to flRendererInitWithConfig.
+ *  maxGlyphs -> how many glyphs fit in a frame before the renderer
+ *      has to flush or grow
+ *  growable -> when the glyphs reach maxGlyphs the storage doubles
+ *      instead of drawing everything so far in the middle of the frame
+ *  streamingFrames -> how many flRendererEnd calls the persistently mapped
+ *      vertex ring buffer can hold in flight, up to
+ *      FL_RENDERER_MAX_STREAMING_FRAMES, FL_RENDERER_STREAMING_FRAMES is
+ *      a good start. 0 disables it. Every flush takes a region of its own,
+ *      so pair it with growable or enough maxGlyphs for a whole frame.
+ *      Flushes in the middle of a frame wait on the GPU once they use up
+ *      the regions.
+ *      Needs OpenGL 4.4 or ARB_buffer_storage. Without them the vertex
+ *      buffer is orphaned and re-uploaded on every flRendererEnd instead.
+ *  instanced -> upload one 40 byte instance per glyph (dest rect, src rect,
+ *      color and the texture slot of the batch) and let the vertex shader
+ *      build the quad corners.
+ *      Rotated glyphs add their origin and rotation, the vertex shader
+ *      turns them.
+ *      Needs OpenGL 3.3 or ARB_instanced_arrays, ignored otherwise.
+ *  textureUnits -> how many different textures a single batch can draw from,
+ *      up to FL_RENDERER_MAX_TEXTURE_UNITS. A new batch, and draw call,
+ *      only starts when they run out. 1 gives a batch per texture.
+ *  multiDrawIndirect -> sample the textures through bindless handles instead
+ *      of texture units and submit all the batches with a single
+ *      glMultiDrawElementsIndirect, or glMultiDrawArraysIndirect when
+ *      instanced. The sampler state of a texture is frozen the first time
+ *      it is drawn. Needs ARB_bindless_texture and OpenGL 4.3.
+ *      Without them every batch binds its textures and draws on its own.
+ *  gpuTimer -> time the GPU work of every frame with GL_TIME_ELAPSED
+ *      queries, see flRendererStats_t.
+ *      Needs OpenGL 3.3 or ARB_timer_query, ignored otherwise.
+ *  compactVertices -> store vertex positions as 16 bit integers and the
+ *      uvs as 16 bit normalized integers, 16 bytes per vertex instead of 24.
+ *      Positions are rounded to whole units and clamped to
+ *      [-32768, 32767], uvs are clamped to [0, 1]. Meant for pixel aligned
+ *      sprites that do not repeat their textures. Not used when instanced.
+ *  programCache -> path of a file the linked shader program is kept in.
+ *      Later runs load it instead of compiling the shaders, as long as the
+ *      shaders and the driver are the same. Otherwise they compile from
+ *      source and the file is rewritten. NULL disables it.
+ *      Needs OpenGL 4.1 or ARB_get_program_binary, ignored otherwise.
+ *  pipelined -> record the next frame while the last one is drawn.
+ *      flRendererEnd only hands the recorded glyphs over and recording
+ *      goes on into a second set of them. flRendererSubmit sorts, batches
+ *      and draws the frame handed over, meant to be called from the thread
+ *      owning the OpenGL context while another one records.
+ *      flRendererEnd waits when the frame before is not submitted yet.
+ *      The glyph storage is always growable, nothing is drawn before
+ *      flRendererSubmit. Uses pthreads, or the Windows locks on Windows.
+ */
+typedef struct flRendererConfig {
+    int maxGlyphs;
+    bool growable;
+    int streamingFrames;
+    bool instanced;
+    int textureUnits;
+    bool multiDrawIndirect;
+    bool gpuTimer;
+    bool compactVertices;
+    const char *programCache;
+    bool pipelined;
+} flRendererConfig_t;
+
+/*
+ * What the renderer did in a frame, everything between two flRendererEnd,
+ * or two flRendererSubmit in the pipelined mode.
+ *  glyphs -> glyphs drawn, the ones of retained layers included
+ *  culled -> glyphs dropped by culling
+ *  flushes -> times the glyphs were drawn in the middle of the frame
+ *      because the storage was full
+ *  batches, drawCalls, textureBinds -> render batches and what the
+ *      backend issued to draw them
+ *  uploadedBytes -> glyph data written for the GPU
+ *  sortTime, expandTime, uploadTime -> seconds of CPU time spent sorting
+ *      the glyphs, writing their vertices and in the backend uploading
+ *      and drawing them
+ *  gpuTime -> seconds the GPU spent on the frame FL_RENDERER_GPU_TIMER_FRAMES
+ *      frames back, or less when it was late. -1 without config.gpuTimer
+ *      and until a result is available.
+ *  glyphsHighWater, batchesHighWater -> the most glyphs and render batches
+ *      a single flush had since the renderer was initialized, to size
+ *      maxGlyphs by. Debug builds only, so build everything including
+ *      this file with the same NDEBUG.
+ */
+typedef struct flRendererStats {
+    int glyphs;
+    int culled;
+    int flushes;
+    int batches;
+    int drawCalls;
+    int textureBinds;
+    size_t uploadedBytes;
+    double sortTime;
+    double expandTime;
+    double uploadTime;
+    double gpuTime;
+#ifndef NDEBUG
+    int glyphsHighWater;
+    int batchesHighWater;
+#endif
+} flRendererStats_t;
+
+/*
+ * A run of glyphs drawn with a single draw call.
+ * offset and numGlyphs are in glyphs. The textures of the batch are
+ * numTextures consecutive entries of the batch textures starting at
+ * firstTexture, bound to units 0, 1, ...
+ * firstTransform is -1 unless the batch holds rotated glyphs in the
+ * instanced mode, then it is where their transforms start.
+ */
+typedef struct flRenderBatch {
+    int offset;
+    int numGlyphs;
+    int firstTexture;
+    int numTextures;
+    int firstTransform;
+} flRenderBatch_t;
+
+/*
+ * The part of the renderer that talks to the GPU.
+ * The renderer records, culls, sorts and batches the glyphs and writes
+ * their data. The backend uploads and draws it. user is passed back
+ * to every function.
+ * A glyph's data is 4 vertices of
+ *      { float x, y, u, v; GLuint color, slot; }
+ * or, when config->compactVertices is left on,
+ *      { GLshort x, y; GLushort u, v; GLuint color, slot; }
+ * in the order topLeft, bottomLeft, bottomRight, topRight or,
+ * when config->instanced is left on, a single instance of
+ *      { float destRect[4], srcRect[4]; GLuint color, slot; }
+ * The vertices of rotated glyphs are already rotated. Rotated instances
+ * are batched on their own and, after the instances of all the glyphs,
+ * come their transforms
+ *      { float origin[2], rotation; }
+ * from the firstTransform of their batch on. An instance has to be turned
+ * by rotation around origin, relative to the top left corner.
+ * slot is the texture of the glyph's batch or, when
+ * config->multiDrawIndirect is left on, the index into all the batch textures.
+ *  configure -> turn off the parts of config the backend cannot do.
+ *      Called before anything is allocated.
+ *  init -> create the GPU objects. Returns 0 on success.
+ *  setProjection -> use pr_matrix from now on.
+ *  map -> memory where the data of the next glyphs glyphs is written,
+ *      NULL on failure. Only used when config->streamingFrames is left
+ *      above 0, the data is written to a staging copy otherwise.
+ *  draw -> upload the data of glyphs glyphs, unless it was mapped,
+ *      and draw the batches. It ends after the transform of the last
+ *      glyph of the last batch with a firstTransform, if there is one.
+ *  createBuffer, uploadBuffer, drawBuffer, deleteBuffer -> the same for
+ *      the buffers retained layers keep across frames. uploadBuffer updates
+ *      count glyphs from first, out of glyphs glyphs in data.
+ *  endFrame -> add what the backend keeps count of, draw calls, texture
+ *      binds and the GPU time, to stats. Called by flRendererEnd.
+ *  destroy -> delete everything init and the buffers created.
+ */
+typedef struct flRendererBackend {
+    void *user;
+    void (*configure)(void *user, flRendererConfig_t *config);
+    bool (*init)(void *user, const flRendererConfig_t *config);
+    void (*setProjection)(void *user, const flMat4_t *pr_matrix);
+    unsigned char *(*map)(void *user, int glyphs);
+    void (*draw)(void *user, const unsigned char *data, int glyphs,
+        const flRenderBatch_t *batches, int numBatches,
+        const GLuint *batchTextures);
+    void *(*createBuffer)(void *user);
+    void (*uploadBuffer)(void *user, void *buffer, const unsigned char *data,
+        int glyphs, int first, int count);
+    void (*drawBuffer)(void *user, void *buffer, int glyphs,
+        const flRenderBatch_t *batches, int numBatches,
+        const GLuint *batchTextures);
+    void (*deleteBuffer)(void *user, void *buffer);
+    void (*endFrame)(void *user, flRendererStats_t *stats);
+    void (*destroy)(void *user);
+} flRendererBackend_t;
+
+/*
+ * What the null backend was handed, added up since it was filled out.
+ *  frames -> flushes drawn, by flRendererEnd and in the middle of frames
+ *  glyphs, batches -> glyphs and render batches drawn, layers included
+ *  uploadedBytes -> glyph data handed over to be uploaded
+ *  data, dataSize -> the glyph data of the last flush. Owned by the
+ *      backend and freed by flRendererDestroy.
+ */
+typedef struct flRendererRecording {
+    int frames;
+    size_t glyphs;
+    size_t batches;
+    size_t uploadedBytes;
+    unsigned char *data;
+    size_t dataSize;
+    size_t dataCapacity;
+} flRendererRecording_t;
+
+/*
+ * Where the renderer takes the scratch storage of a flush from:
+ * the sorted keys, the staging vertex data and the batches.
+ * alloc returns size bytes aligned to 16, or NULL when it is out of them.
+ * Nothing is freed, the memory is only used until the flush returns.
+ * Meant for an arena reset once per frame, see flstd_arena_scratch.
+ */
+typedef struct flRendererScratch {
+    void *user;
+    void *(*alloc)(void *user, size_t size);
+} flRendererScratch_t;
+
+#ifndef FL_HEADLESS
+
+/**
+ * Fill out with the OpenGL backend, the default one.
+ * @param out: the backend to fill
+ */
+FLAPI void flRendererGLBackend(flRendererBackend_t *out);
+
+/**
+ * Forget the OpenGL state the renderer tracks.
+ * The renderer skips binding the program, vertex array, buffer and
+ * textures it knows are bound and only uploads the projection when it
+ * changes. What it knows is kept from one frame to the next, and its
+ * vertex array, buffer and textures stay bound after flRendererEnd.
+ * Call this after GL calls of your own that bind a program, vertex array,
+ * array buffer or texture, or change the active texture unit, before the
+ * renderer draws again. That is between frames as much as in the middle
+ * of one.
+ */
+FLAPI void flRendererInvalidateGLState();
+
+/**
+ * Release the bindless handle the renderer keeps for a texture.
+ * In indirect mode a texture is made resident the first time it is
+ * drawn and stays resident until this is called. Call it before
+ * deleting the texture, its id may come back for another one.
+ * Does nothing for a texture the renderer holds no handle of.
+ * @param texture: the texture about to be deleted
+ */
+FLAPI void flRendererReleaseTexture(GLuint texture);
+
+#endif /* FL_HEADLESS */
+
+/**
+ * Fill out with the null backend. It draws nothing and needs no OpenGL,
+ * for measuring the CPU side of the renderer or running it headless.
+ * @param recording: where the backend adds up what it is handed.
+ *      Zero it first.
+ * @param out: the backend to fill
+ */
+FLAPI void flRendererNullBackend(flRendererRecording_t *recording,
+        flRendererBackend_t *out);
+
+/**
+ * Pick the backend the renderer draws with.
+ * Call it before the renderer is initialized, it stays until changed.
+ * The OpenGL backend is used unless FL_HEADLESS is defined,
+ * the null one then.
+ * @param backend: the backend to use, copied. NULL picks the default one.
+ */
+FLAPI void flRendererSetBackend(const flRendererBackend_t *backend);
+
+/**
+ * Take the scratch storage of every flush from the caller's allocator
+ * instead of keeping it around in the renderer.
+ * Call it between frames, from the thread drawing them.
+ * @param scratch: the allocator to use, copied. NULL goes back to the
+ *      renderer's own storage.
+ */
+FLAPI void flRendererSetScratch(const flRendererScratch_t *scratch);
+
 /**
  * Initializes the renderer.
  * Creates and sets up the shader, the vertex array and the vertex buffer.
  * Should be called once and *AFTER* the OpenGL context has been created.
+ * Same as flRendererInitWithConfig with FL_RENDERER_MAX_GLYPHS glyphs,
+ * no growth, no streaming, no instancing,
+ * FL_RENDERER_MAX_TEXTURE_UNITS texture units and no indirect drawing.
  */
 FLAPI void flRendererInit();
 
+/**
+ * Initializes the renderer with the given settings.
+ * Should be called once and *AFTER* the OpenGL context has been created.
+ * @param config: the renderer settings. See flRendererConfig_t.
+ */
+FLAPI void flRendererInitWithConfig(const flRendererConfig_t *config);
+
 /**
  * Set the projection matrix for the renderer to use.
- * It pushes it directly to OpenGL.
+ * The upload to OpenGL waits until the renderer next uses its shader to
+ * draw, in the pipelined mode it goes along with the next frame handed
+ * over instead.
  * Call this after renderer has been initialized.
+ * Glyphs drawn afterwards that end up completely outside of it are
+ * culled. Projections with a perspective divide are never culled against.
  * @param pr_matrix: the projection matrix to use.
  */
 FLAPI void flRendererSetProjectionMatrix(const flMat4_t *pr_matrix);
 
+/**
+ * Limit the glyphs kept to the ones overlapping viewRect, on top of
+ * the projection. Glyphs completely outside of it are culled.
+ * Do not change it while render contexts are recording.
+ * @param viewRect: the rectangle in the coordinates of the destination
+ *      rectangles, as x, y, width, height. NULL removes the limit.
+ */
+FLAPI void flRendererSetViewRect(const flVec4_t *viewRect);
+
+/**
+ * How many glyphs were culled since flRendererBegin.
+ * After flRendererEnd it includes the glyphs culled by the render contexts.
+ */
+FLAPI int flRendererGetCulledCount();
+
+/**
+ * What the renderer did in the last frame flRendererEnd finished.
+ * In the pipelined mode the last one flRendererSubmit finished,
+ * call it from the same thread.
+ * @param stats: where to store them
+ */
+FLAPI void flRendererGetStats(flRendererStats_t *stats);
+
+/*
+ * How flRendererEnd orders the glyphs of a frame before batching them.
+ * Glyphs that compare equal always keep their submission order.
+ *  FL_SORT_NONE -> submission order. Only neighbouring glyphs are batched
+ *      together, for translucent sprites that overlap.
+ *  FL_SORT_TEXTURE -> by texture id, the fewest batches.
+ *  FL_SORT_LAYER_TEXTURE -> by layer, lowest first, then by texture id.
+ *  FL_SORT_FRONT_TO_BACK -> by depth, lowest first, then by texture id.
+ *  FL_SORT_BACK_TO_FRONT -> by depth, highest first, then by texture id.
+ * The layer and the depth come from flRendererDrawLayered and are 0
+ * for glyphs drawn with flRendererDraw.
+ */
+typedef enum flSortMode {
+    FL_SORT_NONE,
+    FL_SORT_TEXTURE,
+    FL_SORT_LAYER_TEXTURE,
+    FL_SORT_FRONT_TO_BACK,
+    FL_SORT_BACK_TO_FRONT
+} flSortMode_t;
+
 /**
  * Begin the drawing sequence.
+ * Same as flRendererBeginWithSortMode with FL_SORT_TEXTURE.
  */
 FLAPI void flRendererBegin();
 
+/**
+ * Begin the drawing sequence with the given sort mode.
+ * The render contexts record with it as well, so start them after this.
+ * @param sortMode: how the glyphs are ordered. See flSortMode_t.
+ */
+FLAPI void flRendererBeginWithSortMode(flSortMode_t sortMode);
+
 /**
  * Draw a textured rectangle.
  * The destination rectangle should have:
@@ -184,18 +657,187 @@ FLAPI void flRendererBegin();
 FLAPI void flRendererDraw(GLuint texture, flVec4_t destRectangle,
         flVec4_t srcRectangle, GLuint color);
 
+/**
+ * Draw a textured rectangle on a layer and at a depth.
+ * Takes the same arguments as flRendererDraw.
+ * Which of layer and depth is used depends on the sort mode of the frame.
+ * @param layer: glyphs on lower layers are drawn first
+ * @param depth: the distance from the viewer
+ */
+FLAPI void flRendererDrawLayered(GLuint texture, flVec4_t destRectangle,
+        flVec4_t srcRectangle, GLuint color, int layer, float depth);
+
+/**
+ * Draw count textured rectangles from arrays, all at once.
+ * Same as calling flRendererDraw for each of them, without the per call
+ * overhead. Room for all of them is made once when the renderer is growable.
+ * Every array is read with its own stride, the bytes from one element to
+ * the next. Pass the size of the element for a packed array, the size of
+ * the struct for a field of an array of structs or 0 to use the first
+ * element for all of them.
+ * @param count: how many rectangles to draw
+ * @param textures, textureStride: the texture of each rectangle
+ * @param destRectangles, destStride: the destination rectangles
+ * @param srcRectangles, srcStride: the source rectangles
+ * @param colors, colorStride: the colors, 0xAABBGGRR format
+ */
+FLAPI void flRendererDrawMany(int count,
+        const GLuint *textures, size_t textureStride,
+        const flVec4_t *destRectangles, size_t destStride,
+        const flVec4_t *srcRectangles, size_t srcStride,
+        const GLuint *colors, size_t colorStride);
+
+/**
+ * Draw a rotated and scaled textured rectangle.
+ * The rectangle is placed so origin lands on position and is rotated
+ * around it, the rotation is done by the vertex shader in the instanced
+ * mode. Takes the texture, srcRectangle and color of flRendererDraw.
+ * @param position: where origin ends up
+ * @param size: the size of the rectangle before scaling
+ * @param origin: the point of the rectangle it is placed, rotated and scaled
+ *      by, from its top left corner and before scaling
+ * @param rotation: the rotation in radians, clockwise with y going down
+ * @param scale: multiplies size, negative values flip the rectangle
+ */
+FLAPI void flRendererDrawTransformed(GLuint texture, flVec2_t position,
+        flVec2_t size, flVec2_t origin, float rotation, flVec2_t scale,
+        flVec4_t srcRectangle, GLuint color);
+
+/*
+ * A glyph recording buffer that is not tied to the OpenGL thread.
+ * Give each worker thread its own context and draw into it with
+ * flRenderContextDraw. No locks are taken, a context must only be
+ * recorded from one thread at a time.
+ * flRendererEnd merges every context into the frame and empties them,
+ * so all recording has to be finished (the workers joined) before it runs.
+ * flRendererDraw records into a default context owned by the renderer.
+ */
+typedef struct flRenderContext flRenderContext_t;
+
+/**
+ * Create a recording context.
+ * Call it from the thread that calls flRendererEnd.
+ * @param maxGlyphs: the initial glyph capacity. It grows when needed.
+ * @return the new context or NULL if out of memory.
+ */
+FLAPI flRenderContext_t *flRenderContextCreate(int maxGlyphs);
+
+/**
+ * Draw a textured rectangle into a recording context.
+ * Same as flRendererDraw, except that it never flushes.
+ * It is culled the same way.
+ * @param context: the context to record into
+ * @param texture:  the texture id
+ * @param destRectangle: the destination rectangle
+ * @param srcRectangle: the source rectangle
+ * @param color: the integer color to use for blending 0xAABBGGRR format
+ */
+FLAPI void flRenderContextDraw(flRenderContext_t *context, GLuint texture,
+        flVec4_t destRectangle, flVec4_t srcRectangle, GLuint color);
+
+/**
+ * Draw a textured rectangle into a recording context on a layer
+ * and at a depth. See flRendererDrawLayered.
+ */
+FLAPI void flRenderContextDrawLayered(flRenderContext_t *context,
+        GLuint texture, flVec4_t destRectangle, flVec4_t srcRectangle,
+        GLuint color, int layer, float depth);
+
+/**
+ * Destroy a recording context. Glyphs it still holds are dropped.
+ * Call it from the thread that calls flRendererEnd.
+ * @param context: the context to destroy
+ */
+FLAPI void flRenderContextDestroy(flRenderContext_t *context);
+
+/*
+ * A set of glyphs that is recorded once and drawn every frame
+ * from its own vertex buffer, for backgrounds, tilemaps, HUD frames
+ * and anything else that rarely changes.
+ * The glyphs are only sorted, batched and uploaded again after
+ * flRetainedLayerDraw, flRetainedLayerClear or a texture change.
+ * flRetainedLayerSet with the same texture re-uploads just the
+ * range of the glyphs that changed.
+ * Layers are not culled, the view usually moves over them, and are
+ * always sorted by texture id.
+ * All of these must be called from the OpenGL thread.
+ */
+typedef struct flRetainedLayer flRetainedLayer_t;
+
+/**
+ * Create a retained layer.
+ * @param maxGlyphs: the initial glyph capacity. It grows when needed.
+ * @return the new layer or NULL if out of memory.
+ */
+FLAPI flRetainedLayer_t *flRetainedLayerCreate(int maxGlyphs);
+
+/**
+ * Add a textured rectangle to the layer.
+ * Takes the same arguments as flRendererDraw.
+ * @param layer: the layer to add to
+ * @return the index of the glyph in the layer, for flRetainedLayerSet
+ *      or -1 if out of memory.
+ */
+FLAPI int flRetainedLayerDraw(flRetainedLayer_t *layer, GLuint texture,
+        flVec4_t destRectangle, flVec4_t srcRectangle, GLuint color);
+
+/**
+ * Replace a glyph of the layer.
+ * @param layer: the layer the glyph belongs to
+ * @param glyph: the index returned by flRetainedLayerDraw
+ * The rest of the arguments are the same as flRendererDraw.
+ */
+FLAPI void flRetainedLayerSet(flRetainedLayer_t *layer, int glyph,
+        GLuint texture, flVec4_t destRectangle, flVec4_t srcRectangle,
+        GLuint color);
+
+/**
+ * Remove all the glyphs of the layer so it can be recorded again.
+ * @param layer: the layer to clear
+ */
+FLAPI void flRetainedLayerClear(flRetainedLayer_t *layer);
+
+/**
+ * Draw the layer right away with the renderer's shader and projection.
+ * Rebuilds or re-uploads whatever changed since the last call.
+ * Layers drawn before flRendererEnd end up below the glyphs it draws.
+ * In the pipelined mode call it from the thread calling flRendererSubmit,
+ * the layers drawn before it end up below.
+ * @param layer: the layer to draw
+ */
+FLAPI void flRetainedLayerRender(flRetainedLayer_t *layer);
+
+/**
+ * Destroy the layer and its vertex buffer.
+ * @param layer: the layer to destroy
+ */
+FLAPI void flRetainedLayerDestroy(flRetainedLayer_t *layer);
+
 /**
  * Here is where the actual drawing happens.
- * It sorts all the vertices and batches them based on the texture id
- * Each batch contains the offset in the vertices array that it starts from
- * as well as the number of vertices it holds.
+ * It sorts all the glyphs, as the sort mode says, and batches them
+ * based on the texture id
+ * Each glyph is pushed as 4 vertices and drawn through a static index buffer,
+ * or as a single instance in the instanced mode.
+ * Each batch contains the glyph that it starts from,
+ * the number of glyphs it holds and up to textureUnits textures.
  * The next batch starts from where the last one ended
+ * The glyphs of every flRenderContext_t are merged in first.
+ * In the pipelined mode they are only handed over to flRendererSubmit.
  */
 FLAPI void flRendererEnd();
 
+/**
+ * Draw the frame the last flRendererEnd handed over in the pipelined mode,
+ * waiting for it when there is none yet. Does nothing otherwise.
+ * Call it from the thread owning the OpenGL context.
+ */
+FLAPI void flRendererSubmit();
+
 /**
  * Clean up code.
- * Free the vertex array, the vertex buffer and delete the shader program
+ * Let the backend delete the vertex array, the buffers and the shader
+ * program and free the glyph storage
  */
 FLAPI void flRendererDestroy();
 
@@ -207,94 +849,2295 @@ FL_END_DECLS
 
 #ifdef FL_IMPLEMENTATION
 
-static unsigned int __fl_vao;
-static unsigned int __fl_vbo;
-static unsigned int __fl_shader;
+#if !defined(FL_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define FL_SIMD_SSE2
+#include <emmintrin.h> /* SSE2 intrinsics */
+#elif !defined(FL_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define FL_SIMD_NEON
+#include <arm_neon.h> /* NEON intrinsics */
+#endif
 
-static const char *__fl_vertex_shader =
-"#version 150 \n"
-"in vec2 position; \n"
-"in vec2 uv; \n"
-"in vec4 color; \n"
-"uniform mat4 pr_matrix = mat4(1.0); \n"
-"out vec2 vsUV; \n"
-"out vec4 vsColor; \n"
-"void main() { \n"
-"    gl_Position = pr_matrix * vec4(position, 0.0, 1.0); \n"
-"    vsUV = uv; \n"
-"    vsColor = color; \n"
-"} \n";
+#include <math.h> /* fabsf */
+#include <float.h> /* FLT_MAX */
 
-static const char *__fl_fragment_shader =
-"#version 150 \n"
-"out vec4 outColor; \n"
-"uniform sampler2D textureSampler; \n"
-"in vec2 vsUV; \n"
-"in vec4 vsColor; \n"
-"void main() { \n"
-"    outColor = texture(textureSampler, vsUV) * vsColor; \n"
-"} \n";
+/*
+ * A monotonic clock in seconds for the frame statistics.
+ * Define FL_TIME before including this file to use your own.
+ */
+#ifndef FL_TIME
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h> /* QueryPerformanceCounter */
+static double fl_time()
+{
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+#else
+#include <time.h> /* clock_gettime */
+static double fl_time()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+#endif
+#define FL_TIME() fl_time()
+#endif
+
+/*
+ * The pipelined mode hands frames from the recording thread
+ * to the submitting one under a lock
+ */
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h> /* SRWLOCK, CONDITION_VARIABLE */
+static SRWLOCK __fl_frame_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE __fl_frame_cond = CONDITION_VARIABLE_INIT;
+#define FL_FRAME_LOCK() AcquireSRWLockExclusive(&__fl_frame_lock)
+#define FL_FRAME_UNLOCK() ReleaseSRWLockExclusive(&__fl_frame_lock)
+#define FL_FRAME_WAIT() \
+    SleepConditionVariableSRW(&__fl_frame_cond, &__fl_frame_lock, INFINITE, 0)
+#define FL_FRAME_SIGNAL() WakeAllConditionVariable(&__fl_frame_cond)
+#else
+#include <pthread.h> /* pthread_mutex_t, pthread_cond_t */
+static pthread_mutex_t __fl_frame_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __fl_frame_cond = PTHREAD_COND_INITIALIZER;
+#define FL_FRAME_LOCK() pthread_mutex_lock(&__fl_frame_lock)
+#define FL_FRAME_UNLOCK() pthread_mutex_unlock(&__fl_frame_lock)
+#define FL_FRAME_WAIT() pthread_cond_wait(&__fl_frame_cond, &__fl_frame_lock)
+#define FL_FRAME_SIGNAL() pthread_cond_broadcast(&__fl_frame_cond)
+#endif
 
+/*
+ * slot is the texture unit, of the batch, the glyph samples from.
+ * In the indirect mode it is the index of the texture in the whole
+ * batchTextures array instead.
+ */
 typedef struct flVertex {
 	flVec2_t position;
 	struct flVec2 uv;
 	GLuint color;
+	GLuint slot;
 } flVertex_t;
 
+/*
+ * The vertex of the compact vertex format. u and v are normalized,
+ * 65535 is 1.0
+ */
+typedef struct flCompactVertex {
+	GLshort x;
+	GLshort y;
+	GLushort u;
+	GLushort v;
+	GLuint color;
+	GLuint slot;
+} flCompactVertex_t;
+
+/*
+ * A glyph exactly as it was passed to flRendererDraw.
+ * This is also the per instance data of the instanced mode, 40 bytes:
+ * the 36 of the rectangles and the color plus the texture slot the
+ * batch samples it from.
+ */
+typedef struct flInstance {
+	flVec4_t destRect;
+	flVec4_t srcRect;
+	GLuint color;
+	GLuint slot;
+} flInstance_t;
+
+/*
+ * What flRendererDrawTransformed adds to a glyph.
+ * It turns by rotation around origin, which is relative to the top left
+ * corner of destRect. Other glyphs have a rotation of 0.
+ * Only the instances of rotated glyphs carry it to the GPU,
+ * in their own stream after the instances.
+ */
+typedef struct flTransform {
+	flVec2_t origin;
+	float rotation;
+} flTransform_t;
+
 typedef struct flGlyph {
 	GLuint texture;
-	struct flVertex topLeft;
-	struct flVertex bottomLeft;
-	struct flVertex bottomRight;
-	struct flVertex topRight;
+	struct flInstance instance;
+	struct flTransform transform;
 } flGlyph_t;
 
-typedef struct flRenderBatch {
-	int offset;
-	int numVertices;
-	GLuint texture;
-} flRenderBatch_t;
+/*
+ * Glyphs are never moved while sorting.
+ * Instead each one gets a key built from its draw state and the sort
+ * works on these small records, carrying the glyph index along.
+ * The texture id is always the low 32 bits, the high ones hold
+ * the layer or the depth. See fl_sort_key.
+ */
+typedef struct flSortKey {
+	GLuint64 key;
+	GLuint glyph;
+} flSortKey_t;
 
 #define FL_VERTEX_SIZE sizeof(flVertex_t)
+#define FL_COMPACT_VERTEX_SIZE sizeof(flCompactVertex_t)
+#define FL_INSTANCE_SIZE sizeof(flInstance_t)
+#define FL_TRANSFORM_SIZE sizeof(flTransform_t)
 #define FL_GLYPH_SIZE sizeof(flGlyph_t)
+#define FL_SORT_KEY_SIZE sizeof(flSortKey_t)
 #define FL_RENDER_BATCH_SIZE sizeof(flRenderBatch_t)
-#define FL_RENDERER_MAX_GLYPHS 1000
-#define FL_RENDERER_MAX_VERTICES FL_RENDERER_MAX_GLYPHS * 6
-#define FL_RENDERER_MAX_RENDER_BATCHES FL_RENDERER_MAX_GLYPHS
+#define FL_GLYPH_VERTICES 4
+#define FL_GLYPH_INDICES 6
 
-static int __fl_glyphs_size = 0;
-static flGlyph_t __fl_glyphs[FL_RENDERER_MAX_GLYPHS];
-static flVertex_t __fl_vertices[FL_RENDERER_MAX_VERTICES];
-static flRenderBatch_t __fl_renderBatches[FL_RENDERER_MAX_RENDER_BATCHES];
+static flRendererConfig_t __fl_config;
 
-/**
- * Create an identity matrix.
- * @param out: the matrix to store the result.
+/*
+ * The mode actually in use, the config asks for it
+ * but the driver may not support it.
+ * Each glyph takes __fl_glyph_stride bytes in the vertex buffer and
+ * at most __fl_glyph_space, its transform included, in the instanced mode.
  */
-FLAPI void flMat4Identity(flMat4_t *out)
-{
-    memset(out->data, 0, sizeof(flMat4_t));
+static bool __fl_instanced = false;
+static bool __fl_compact = false;
+static int __fl_glyph_stride = 0;
+static int __fl_glyph_space = 0;
+static int __fl_texture_units = 1;
+static bool __fl_indirect = false;
 
-    out->data[0 * 4 + 0]  = 1.0f;
-    out->data[1 * 4 + 1]  = 1.0f;
-    out->data[2 * 4 + 2]  = 1.0f;
-    out->data[3 * 4 + 3]  = 1.0f;
-}
+/*
+ * The glyphs recorded for a frame and their sort keys
+ * key.glyph is the index of the glyph in this context.
+ * culled counts the glyphs that were rejected instead of recorded.
+ */
+struct flRenderContext {
+	flGlyph_t *glyphs;
+	flSortKey_t *sortKeys;
+	int size;
+	int capacity;
+	int culled;
+	struct flRenderContext *next;
+};
 
-/**
- * Create an orthographic projection matrix.
- * @param left
- * @param right
- * @param bottom
- * @param top
- * @param near
- * @param far
- * @param out: the matrix to store the result.
+/*
+ * __fl_context is the default context, the one flRendererDraw records into
+ * and the one every other context in the __fl_contexts list is merged into.
+ * All the per glyph storage of flRendererEnd is allocated with its capacity,
+ * or the one of the frame handed over in the pipelined mode.
+ * There can never be more vertices or render batches than glyphs need.
+ * The index buffer on the GPU may lag behind after a growth
+ * and is rebuilt on the next flRendererEnd.
  */
-FLAPI void flMat4Ortho(float left, float right, float bottom, float top,
-        float near, float far, flMat4_t *out)
-{
-    flMat4Identity(out);
+static flRenderContext_t __fl_context;
+static flRenderContext_t *__fl_contexts;
+
+/*
+ * The sort mode of the current frame, the keys are built with it
+ */
+static flSortMode_t __fl_sort_mode = FL_SORT_TEXTURE;
+
+/*
+ * A frame handed over by flRendererEnd in the pipelined mode.
+ * Its context swaps glyphs with the default one, which goes on
+ * recording into the ones flRendererSubmit drew last.
+ * The projection set while recording goes along with it.
+ * pending is set from the hand over until flRendererSubmit is done
+ * with it. Only the thread that set it, or cleared it, touches the rest.
+ */
+typedef struct flFrame {
+	flRenderContext_t context;
+	flSortMode_t sortMode;
+	flMat4_t projection;
+	bool projectionSet;
+	bool pending;
+} flFrame_t;
+
+static flFrame_t __fl_frame;
+static flMat4_t __fl_frame_projection;
+static bool __fl_frame_projection_set = false;
+
+/*
+ * Culling.
+ * The x, y rows of the projection, as it maps a point to clip space.
+ * A glyph is kept when its rectangle, mapped by them, overlaps the
+ * [-1, 1] square and also overlaps the view rect, kept as min and max.
+ * The defaults are the identity the shader starts with and no view rect.
+ */
+static float __fl_cull_row[2][3] = { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f } };
+static float __fl_cull_view[4] = { -FLT_MAX, -FLT_MAX, FLT_MAX, FLT_MAX };
+
+/*
+ * A retained layer keeps its recorded glyphs, and their keys, in record
+ * order in context. The keys are sorted in a copy kept in sortKeys.
+ * positions tells where each recorded glyph ended up after sorting
+ * and data is the CPU side copy of the vertex buffer.
+ * Glyphs from dirtyFirst to dirtyLast are re-uploaded on the next render,
+ * a full rebuild happens when rebuild is set.
+ * buffer is the backend's copy of data.
+ */
+struct flRetainedLayer {
+	flRenderContext_t context;
+	flSortKey_t *sortKeys;
+	GLuint *positions;
+	unsigned char *data;
+	flRenderBatch_t *batches;
+	GLuint *batchTextures;
+	int numBatches;
+	int capacity;
+	bool rebuild;
+	int dirtyFirst;
+	int dirtyLast;
+	void *buffer;
+};
+/*
+ * The per glyph storage of a flush, for __fl_flush_capacity glyphs
+ */
+static flSortKey_t *__fl_sortKeysTmp;
+static unsigned char *__fl_vertexData;
+static flRenderBatch_t *__fl_renderBatches;
+static GLuint *__fl_batchTextures;
+static int __fl_flush_capacity = 0;
+
+/*
+ * The allocator flushes take their storage from instead, when set
+ */
+static flRendererScratch_t __fl_scratch;
+
+/*
+ * The backend everything is drawn with, set by flRendererSetBackend
+ * or picked at init
+ */
+static flRendererBackend_t __fl_backend;
+static bool __fl_backend_set = false;
+
+/*
+ * The statistics of the frame being drawn and of the last one finished
+ */
+static flRendererStats_t __fl_stats;
+static flRendererStats_t __fl_frame_stats;
+
+#ifndef NDEBUG
+/*
+ * The arrays are never cleared, only overwritten.
+ * Keep track of how much of them was ever used instead
+ */
+static int __fl_glyphs_highWater = 0;
+static int __fl_renderBatches_highWater = 0;
+#endif
+
+static void fl_renderer_flush(flRenderContext_t *context,
+        flSortMode_t sortMode);
+
+/*
+ * Resize the glyphs of a context to hold capacity glyphs.
+ * The contents up to the current size are kept.
+ * Returns 0 on success. On failure nothing is changed.
+ */
+static bool fl_context_reserve(flRenderContext_t *context, int capacity)
+{
+    if (capacity <= context->capacity) return 0;
+
+    void *glyphs = realloc(context->glyphs, FL_GLYPH_SIZE * capacity);
+    if (glyphs == NULL) return -1;
+    context->glyphs = (flGlyph_t *)glyphs;
+
+    void *keys = realloc(context->sortKeys, FL_SORT_KEY_SIZE * capacity);
+    if (keys == NULL) return -1;
+    context->sortKeys = (flSortKey_t *)keys;
+
+    context->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Build the sort key of a glyph for the sort mode of the frame.
+ * Layers are stored with the sign bit flipped and depths with the
+ * float made sortable as an unsigned integer, negative values included.
+ */
+static GLuint64 fl_sort_key(GLuint texture, int layer, float depth)
+{
+    GLuint bits;
+    switch (__fl_sort_mode) {
+    case FL_SORT_NONE:
+        return 0;
+    case FL_SORT_LAYER_TEXTURE:
+        bits = (GLuint)layer ^ 0x80000000u;
+        break;
+    case FL_SORT_FRONT_TO_BACK:
+    case FL_SORT_BACK_TO_FRONT:
+        memcpy(&bits, &depth, sizeof(bits));
+        bits ^= (GLuint)(-(GLint)(bits >> 31)) | 0x80000000u;
+        if (__fl_sort_mode == FL_SORT_BACK_TO_FRONT) bits = ~bits;
+        break;
+    default:
+        return texture;
+    }
+    return ((GLuint64)bits << 32) | texture;
+}
+
+/*
+ * Store a glyph, and its sort key, at index of the context.
+ * The rectangles are stored as they are.
+ * They are turned into vertices in flRendererEnd, after sorting.
+ */
+static void fl_context_write(flRenderContext_t *context, int index,
+        GLuint64 key, GLuint texture, const flVec4_t *destRectangle,
+        const flVec4_t *srcRectangle, GLuint color)
+{
+    /*
+     * Record the sort key of the glyph next to its index
+     */
+    context->sortKeys[index].key = key;
+    context->sortKeys[index].glyph = index;
+
+    flGlyph_t *glyph = &context->glyphs[index];
+    glyph->texture = texture;
+    glyph->instance.destRect = *destRectangle;
+    glyph->instance.srcRect = *srcRectangle;
+    glyph->instance.color = color;
+    glyph->transform.origin.x = 0.0f;
+    glyph->transform.origin.y = 0.0f;
+    glyph->transform.rotation = 0.0f;
+}
+
+/*
+ * 1 when the rectangle overlaps what the projection and the view rect show.
+ * The rectangle is taken as its center and half size and its bounding box
+ * in clip space is compared against [-1, 1]. No branches, most of the glyphs
+ * of a scrolling world are culled so they would be mispredicted a lot.
+ */
+static int fl_cull_visible(const flVec4_t *rect)
+{
+    float hw = fabsf(rect->z) * 0.5f;
+    float hh = fabsf(rect->w) * 0.5f;
+    float cx = rect->x + rect->z * 0.5f;
+    float cy = rect->y + rect->w * 0.5f;
+
+    const float *rx = __fl_cull_row[0];
+    const float *ry = __fl_cull_row[1];
+    float px = rx[0] * cx + rx[1] * cy + rx[2];
+    float py = ry[0] * cx + ry[1] * cy + ry[2];
+    float ex = fabsf(rx[0]) * hw + fabsf(rx[1]) * hh;
+    float ey = fabsf(ry[0]) * hw + fabsf(ry[1]) * hh;
+
+    return (fabsf(px) - ex <= 1.0f) & (fabsf(py) - ey <= 1.0f) &
+        (cx + hw >= __fl_cull_view[0]) & (cy + hh >= __fl_cull_view[1]) &
+        (cx - hw <= __fl_cull_view[2]) & (cy - hh <= __fl_cull_view[3]);
+}
+
+/*
+ * Record a glyph unless it is culled. There has to be room for it.
+ * It is always written and only counted when visible,
+ * the next glyph overwrites it otherwise.
+ */
+static void fl_context_push(flRenderContext_t *context, GLuint64 key,
+        GLuint texture, const flVec4_t *destRectangle,
+        const flVec4_t *srcRectangle, GLuint color)
+{
+    int visible = fl_cull_visible(destRectangle);
+
+    fl_context_write(context, context->size, key, texture, destRectangle,
+        srcRectangle, color);
+    context->size += visible;
+    context->culled += visible ^ 1;
+}
+
+/*
+ * Record a rotated glyph unless it is culled.
+ * It is culled by the square around its origin that holds it at any
+ * rotation, made of the farthest reach of the glyph along each axis.
+ */
+static void fl_context_push_rotated(flRenderContext_t *context,
+        GLuint64 key, GLuint texture, const flVec4_t *destRectangle,
+        const flVec4_t *srcRectangle, GLuint color, const flVec2_t *origin,
+        float rotation)
+{
+    float left = fabsf(origin->x);
+    float right = fabsf(destRectangle->z - origin->x);
+    float top = fabsf(origin->y);
+    float bottom = fabsf(destRectangle->w - origin->y);
+    float reach = (left > right ? left : right) + (top > bottom ? top : bottom);
+
+    flVec4_t bounds;
+    bounds.x = destRectangle->x + origin->x - reach;
+    bounds.y = destRectangle->y + origin->y - reach;
+    bounds.z = reach * 2.0f;
+    bounds.w = reach * 2.0f;
+    int visible = fl_cull_visible(&bounds);
+
+    fl_context_write(context, context->size, key, texture, destRectangle,
+        srcRectangle, color);
+    flGlyph_t *glyph = &context->glyphs[context->size];
+    glyph->transform.origin = *origin;
+    glyph->transform.rotation = rotation;
+
+    context->size += visible;
+    context->culled += visible ^ 1;
+}
+
+/*
+ * Resize the per glyph arrays of a flush to hold capacity glyphs.
+ * Returns 0 on success. On failure the ones resized so far are kept.
+ */
+static bool fl_flush_reserve(int capacity)
+{
+    if (capacity <= __fl_flush_capacity) return 0;
+
+    void *tmp = realloc(__fl_sortKeysTmp, FL_SORT_KEY_SIZE * capacity);
+    if (tmp == NULL) return -1;
+    __fl_sortKeysTmp = (flSortKey_t *)tmp;
+
+    if (__fl_config.streamingFrames == 0) {
+        void *data = realloc(__fl_vertexData, __fl_glyph_space * capacity);
+        if (data == NULL) return -1;
+        __fl_vertexData = (unsigned char *)data;
+    }
+
+    void *batches = realloc(__fl_renderBatches, FL_RENDER_BATCH_SIZE * capacity);
+    if (batches == NULL) return -1;
+    __fl_renderBatches = (flRenderBatch_t *)batches;
+
+    void *textures = realloc(__fl_batchTextures, sizeof(GLuint) * capacity);
+    if (textures == NULL) return -1;
+    __fl_batchTextures = (GLuint *)textures;
+
+    __fl_flush_capacity = capacity;
+    return 0;
+}
+
+/*
+ * Free the renderer's own per glyph arrays of a flush
+ */
+static void fl_flush_release()
+{
+    free(__fl_sortKeysTmp);
+    free(__fl_vertexData);
+    free(__fl_renderBatches);
+    free(__fl_batchTextures);
+    __fl_sortKeysTmp = NULL;
+    __fl_vertexData = NULL;
+    __fl_renderBatches = NULL;
+    __fl_batchTextures = NULL;
+    __fl_flush_capacity = 0;
+}
+
+/*
+ * Hand the flush its per glyph arrays for glyphs glyphs, capacity of them
+ * when they are the renderer's own.
+ * Returns 0 on success.
+ */
+static bool fl_flush_storage(int glyphs, int capacity, flSortKey_t **tmp,
+        unsigned char **data, flRenderBatch_t **batches, GLuint **textures)
+{
+    if (__fl_scratch.alloc == NULL) {
+        if (fl_flush_reserve(capacity) != 0) return -1;
+        *tmp = __fl_sortKeysTmp;
+        *data = __fl_vertexData;
+        *batches = __fl_renderBatches;
+        *textures = __fl_batchTextures;
+        return 0;
+    }
+
+    void *user = __fl_scratch.user;
+    *tmp = (flSortKey_t *)__fl_scratch.alloc(user, FL_SORT_KEY_SIZE * glyphs);
+    *data = NULL;
+    if (__fl_config.streamingFrames == 0)
+        *data = (unsigned char *)__fl_scratch.alloc(user,
+            (size_t)__fl_glyph_space * glyphs);
+    *batches = (flRenderBatch_t *)__fl_scratch.alloc(user,
+        FL_RENDER_BATCH_SIZE * glyphs);
+    *textures = (GLuint *)__fl_scratch.alloc(user, sizeof(GLuint) * glyphs);
+
+    if (*tmp == NULL || *batches == NULL || *textures == NULL) return -1;
+    if (__fl_config.streamingFrames == 0 && *data == NULL) return -1;
+    return 0;
+}
+
+/*
+ * Resize the default context to hold capacity glyphs.
+ * The contents up to the current size are kept.
+ * What flushing it needs follows on the next flush, on whichever
+ * thread draws it.
+ * Returns 0 on success.
+ */
+static bool fl_renderer_reserve(int capacity)
+{
+    return fl_context_reserve(&__fl_context, capacity);
+}
+
+/*
+ * Make room for one more glyph in the default context.
+ * Grow it when allowed to, otherwise draw everything so far and start over.
+ * Returns 0 when there is room. The pipelined mode cannot draw
+ * from the recording thread, the glyph has to be dropped when growing fails.
+ */
+static bool fl_renderer_make_room()
+{
+    if (__fl_context.size < __fl_context.capacity) return 0;
+
+    if (__fl_config.growable &&
+            fl_renderer_reserve(__fl_context.capacity * 2) == 0)
+        return 0;
+
+    if (__fl_config.pipelined) {
+        FLASSERT(!"out of memory recording a pipelined frame");
+        return -1;
+    }
+
+    fl_renderer_flush(&__fl_context, __fl_sort_mode);
+    __fl_context.size = 0;
+    __fl_stats.flushes++;
+    return 0;
+}
+
+/*
+ * Move the glyphs of every other context into the default one
+ * so the frame is sorted and batched as a whole.
+ * The default context grows to fit them, growable or not.
+ */
+static void fl_renderer_merge_contexts()
+{
+    flRenderContext_t *context;
+    for (context = __fl_contexts; context != NULL; context = context->next) {
+        __fl_context.culled += context->culled;
+        context->culled = 0;
+        if (context->size == 0) continue;
+
+        int base = __fl_context.size;
+        if (fl_renderer_reserve(base + context->size) != 0) {
+            FLASSERT(!"out of memory merging render contexts");
+            context->size = 0;
+            continue;
+        }
+
+        memcpy(__fl_context.glyphs + base, context->glyphs,
+            FL_GLYPH_SIZE * context->size);
+
+        int i;
+        for (i = 0; i < context->size; i++) {
+            __fl_context.sortKeys[base + i].key = context->sortKeys[i].key;
+            __fl_context.sortKeys[base + i].glyph = base + i;
+        }
+
+        __fl_context.size += context->size;
+        context->size = 0;
+    }
+}
+
+/*
+ * Expand a glyph into its 4 corners in the order
+ * topLeft, bottomLeft, bottomRight, topRight
+ * sampling from texture unit slot
+ */
+static void fl_glyph_vertices(const flGlyph_t *glyph, GLuint slot,
+        flVertex_t *out)
+{
+#ifdef FL_SIMD_SSE2
+    /*
+     * A vertex is (x, y, u, v, color, slot) so the 4 corners are
+     * 96 bytes, or 6 stores of 16 bytes.
+     * lo holds the top left corner, hi the bottom right one and the
+     * other two corners take x, u from one and y, v from the other.
+     */
+    __m128 dest = _mm_loadu_ps(&glyph->instance.destRect.x);
+    __m128 src = _mm_loadu_ps(&glyph->instance.srcRect.x);
+    __m128 lo = _mm_movelh_ps(dest, src);
+    __m128 hi = _mm_add_ps(lo, _mm_movehl_ps(src, dest));
+
+    __m128 lohi0 = _mm_unpacklo_ps(lo, hi);
+    __m128 lohi1 = _mm_unpackhi_ps(lo, hi);
+    __m128 bottomLeft = _mm_shuffle_ps(lohi0, lohi1, _MM_SHUFFLE(3, 0, 3, 0));
+    __m128 topRight = _mm_shuffle_ps(lohi0, lohi1, _MM_SHUFFLE(2, 1, 2, 1));
+
+    __m128 colorSlot = _mm_castsi128_ps(_mm_set_epi32((int)slot,
+        (int)glyph->instance.color, (int)slot, (int)glyph->instance.color));
+
+    float *data = (float *)out;
+    _mm_storeu_ps(data + 0, lo);
+    _mm_storeu_ps(data + 4, _mm_movelh_ps(colorSlot, bottomLeft));
+    _mm_storeu_ps(data + 8, _mm_movehl_ps(colorSlot, bottomLeft));
+    _mm_storeu_ps(data + 12, hi);
+    _mm_storeu_ps(data + 16, _mm_movelh_ps(colorSlot, topRight));
+    _mm_storeu_ps(data + 20, _mm_movehl_ps(colorSlot, topRight));
+#else
+    const flVec4_t *dest = &glyph->instance.destRect;
+    const flVec4_t *src = &glyph->instance.srcRect;
+    GLuint color = glyph->instance.color;
+
+    out[0].position.x = dest->x;
+    out[0].position.y = dest->y;
+    out[0].uv.x = src->x;
+    out[0].uv.y = src->y;
+    out[0].color = color;
+    out[0].slot = slot;
+
+    out[1].position.x = dest->x;
+    out[1].position.y = dest->y + dest->w;
+    out[1].uv.x = src->x;
+    out[1].uv.y = src->y + src->w;
+    out[1].color = color;
+    out[1].slot = slot;
+
+    out[2].position.x = dest->x + dest->z;
+    out[2].position.y = dest->y + dest->w;
+    out[2].uv.x = src->x + src->z;
+    out[2].uv.y = src->y + src->w;
+    out[2].color = color;
+    out[2].slot = slot;
+
+    out[3].position.x = dest->x + dest->z;
+    out[3].position.y = dest->y;
+    out[3].uv.x = src->x + src->z;
+    out[3].uv.y = src->y;
+    out[3].color = color;
+    out[3].slot = slot;
+#endif
+}
+
+/*
+ * Turn the corners fl_glyph_vertices wrote around the origin of the glyph.
+ * The instanced mode leaves this to the vertex shader.
+ */
+static void fl_glyph_rotate(const flGlyph_t *glyph, flVertex_t *out)
+{
+    float c = cosf(glyph->transform.rotation);
+    float s = sinf(glyph->transform.rotation);
+    float px = glyph->instance.destRect.x + glyph->transform.origin.x;
+    float py = glyph->instance.destRect.y + glyph->transform.origin.y;
+
+    int i;
+    for (i = 0; i < FL_GLYPH_VERTICES; i++) {
+        float x = out[i].position.x - px;
+        float y = out[i].position.y - py;
+        out[i].position.x = px + c * x - s * y;
+        out[i].position.y = py + s * x + c * y;
+    }
+}
+
+#ifndef FL_SIMD_SSE2
+/*
+ * Clamp x to [lo, hi], NaN ends up as lo.
+ * Matches _mm_min_ps(_mm_max_ps(x, lo), hi) of the SSE2 path.
+ */
+static float fl_clampf(float x, float lo, float hi)
+{
+    return x > lo ? (x < hi ? x : hi) : lo;
+}
+#endif
+
+/*
+ * Write the 4 corners of a glyph in the compact format.
+ * They are built as floats first, to share the rotation with the
+ * vertex mode, then clamped to the 16 bit ranges and rounded. The
+ * rounded uvs are biased by -32768 so they fit the signed pack too.
+ */
+static void fl_glyph_compact(const flGlyph_t *glyph, GLuint slot,
+        flCompactVertex_t *out)
+{
+    flVertex_t corners[FL_GLYPH_VERTICES];
+    fl_glyph_vertices(glyph, slot, corners);
+    if (glyph->transform.rotation != 0.0f) fl_glyph_rotate(glyph, corners);
+
+#ifdef FL_SIMD_SSE2
+    const __m128 scale = _mm_set_ps(65535.0f, 65535.0f, 1.0f, 1.0f);
+    const __m128 lo = _mm_set_ps(0.0f, 0.0f, -32768.0f, -32768.0f);
+    const __m128 hi = _mm_set_ps(65535.0f, 65535.0f, 32767.0f, 32767.0f);
+    const __m128i bias = _mm_set_epi32(32768, 32768, 0, 0);
+    const __m128i unbias = _mm_set_epi16((short)0x8000, (short)0x8000, 0, 0,
+        (short)0x8000, (short)0x8000, 0, 0);
+    __m128i colorSlot = _mm_set_epi32((int)slot, (int)glyph->instance.color,
+        (int)slot, (int)glyph->instance.color);
+
+    int i;
+    for (i = 0; i < FL_GLYPH_VERTICES; i += 2) {
+        /*
+         * Clamp before converting, huge values and NaN would turn into
+         * 0x80000000 and saturate to the wrong end
+         */
+        __m128 fa = _mm_min_ps(_mm_max_ps(_mm_mul_ps(
+            _mm_loadu_ps(&corners[i].position.x), scale), lo), hi);
+        __m128 fb = _mm_min_ps(_mm_max_ps(_mm_mul_ps(
+            _mm_loadu_ps(&corners[i + 1].position.x), scale), lo), hi);
+        __m128i a = _mm_sub_epi32(_mm_cvtps_epi32(fa), bias);
+        __m128i b = _mm_sub_epi32(_mm_cvtps_epi32(fb), bias);
+        __m128i packed = _mm_xor_si128(_mm_packs_epi32(a, b), unbias);
+
+        _mm_storeu_si128((__m128i *)&out[i],
+            _mm_unpacklo_epi64(packed, colorSlot));
+        _mm_storeu_si128((__m128i *)&out[i + 1],
+            _mm_unpackhi_epi64(packed, colorSlot));
+    }
+#else
+    int i;
+    for (i = 0; i < FL_GLYPH_VERTICES; i++) {
+        float x = corners[i].position.x;
+        float y = corners[i].position.y;
+        float u = corners[i].uv.x * 65535.0f;
+        float v = corners[i].uv.y * 65535.0f;
+
+        out[i].x = (GLshort)lrintf(fl_clampf(x, -32768.0f, 32767.0f));
+        out[i].y = (GLshort)lrintf(fl_clampf(y, -32768.0f, 32767.0f));
+        out[i].u = (GLushort)lrintf(fl_clampf(u, 0.0f, 65535.0f));
+        out[i].v = (GLushort)lrintf(fl_clampf(v, 0.0f, 65535.0f));
+        out[i].color = glyph->instance.color;
+        out[i].slot = slot;
+    }
+#endif
+}
+
+/*
+ * Write the vertices, or the instance, of a glyph at the given position
+ * of the vertex data
+ */
+static void fl_glyph_write(const flGlyph_t *glyph, GLuint slot,
+        unsigned char *data, int position)
+{
+    if (__fl_instanced) {
+        flInstance_t *instance = (flInstance_t *)data + position;
+        *instance = glyph->instance;
+        instance->slot = slot;
+    }
+    else if (__fl_compact) {
+        fl_glyph_compact(glyph, slot,
+            (flCompactVertex_t *)data + position * FL_GLYPH_VERTICES);
+    }
+    else {
+        flVertex_t *vertices = (flVertex_t *)data + position * FL_GLYPH_VERTICES;
+        fl_glyph_vertices(glyph, slot, vertices);
+        if (glyph->transform.rotation != 0.0f) fl_glyph_rotate(glyph, vertices);
+    }
+}
+
+/*
+ * The texture slot a glyph was written with at the given position
+ * of the vertex data
+ */
+static GLuint fl_glyph_slot(const unsigned char *data, int position)
+{
+    if (__fl_instanced)
+        return ((const flInstance_t *)data)[position].slot;
+    if (__fl_compact)
+        return ((const flCompactVertex_t *)data)[position * FL_GLYPH_VERTICES].slot;
+    return ((const flVertex_t *)data)[position * FL_GLYPH_VERTICES].slot;
+}
+
+/*
+ * LSD radix sort of the sort keys, one byte per pass.
+ * The histograms of all the passes are built with a single read of the keys.
+ * Passes where every key has the same digit would not move anything
+ * so they are skipped. With small texture ids that is most of them.
+ * The sort is stable, glyphs with equal keys keep their submission order.
+ * Returns the array that holds the sorted keys, either keys or tmp.
+ */
+static flSortKey_t *fl_sort_keys(flSortKey_t *keys, flSortKey_t *tmp, int size)
+{
+    int histogram[8][256];
+    memset(histogram, 0, sizeof(histogram));
+
+    int i;
+    int pass;
+    for (i = 0; i < size; i++) {
+        GLuint64 key = keys[i].key;
+        for (pass = 0; pass < 8; pass++) {
+            histogram[pass][(key >> (pass * 8)) & 0xFF]++;
+        }
+    }
+
+    for (pass = 0; pass < 8; pass++) {
+        int *count = histogram[pass];
+        int shift = pass * 8;
+
+        if (count[(keys[0].key >> shift) & 0xFF] == size) continue;
+
+        /*
+         * Turn the counts into the starting offset of every digit
+         */
+        int sum = 0;
+        for (i = 0; i < 256; i++) {
+            int c = count[i];
+            count[i] = sum;
+            sum += c;
+        }
+
+        for (i = 0; i < size; i++) {
+            tmp[count[(keys[i].key >> shift) & 0xFF]++] = keys[i];
+        }
+
+        flSortKey_t *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+
+    return keys;
+}
+
+/*
+ * Whether the glyph goes to the GPU with its transform.
+ * Only rotated glyphs of the instanced mode do, the vertex modes
+ * rotate the corners themselves.
+ */
+static bool fl_glyph_transformed(const flGlyph_t *glyph)
+{
+    return __fl_instanced && glyph->transform.rotation != 0.0f;
+}
+
+/*
+ * The bytes of data a flush of glyphs glyphs wrote, the transforms
+ * following the instances included
+ */
+static size_t fl_glyph_data_size(int glyphs, const flRenderBatch_t *batches,
+        int numBatches)
+{
+    size_t size = (size_t)__fl_glyph_stride * glyphs;
+    if (!__fl_instanced) return size;
+
+    int i;
+    for (i = numBatches - 1; i >= 0; i--) {
+        if (batches[i].firstTransform >= 0) {
+            return size + FL_TRANSFORM_SIZE *
+                (batches[i].firstTransform + batches[i].numGlyphs);
+        }
+    }
+    return size;
+}
+
+/*
+ * Walk the glyphs in sorted order, split them in batches and write
+ * their vertices, or instances, to data.
+ * The transforms of rotated instances follow the instances of all
+ * the glyphs, their batches never hold unrotated ones.
+ * batches and batchTextures need room for size entries.
+ * Returns the number of batches.
+ */
+static int fl_renderer_batch(const flGlyph_t *glyphs, const flSortKey_t *keys,
+        int size, unsigned char *data, flRenderBatch_t *batches,
+        GLuint *batchTextures)
+{
+    /*
+     * We setup the first by hand
+     * We use a for loop for the rest of them
+     */
+    const flGlyph_t *glyph = &glyphs[keys[0].glyph];
+    GLuint texture = glyph->texture;
+    GLuint slot = 0;
+    bool transformed = fl_glyph_transformed(glyph);
+    flTransform_t *transforms = (flTransform_t *)(data +
+        (size_t)__fl_glyph_stride * size);
+    int numTransforms = 0;
+
+    int crb = 0;
+    flRenderBatch_t *batch = &batches[crb];
+    batch->offset = 0;
+    batch->numGlyphs = 0;
+    batch->firstTexture = 0;
+    batch->numTextures = 1;
+    batch->firstTransform = transformed ? 0 : -1;
+    batchTextures[0] = texture;
+
+    /*
+     * Use the sorted glyphs array to construct the vertices array
+     * that will be pushed to OpenGL.
+     * The quad's triangles come from the static index buffer so only
+     * the 4 corners are written. Instances are copied as they are.
+     * On each iteration we check the previous glyph what texture id it has
+     */
+    int i;
+    for (i = 0; i < size; i++) {
+        glyph = &glyphs[keys[i].glyph];
+        bool rotated = fl_glyph_transformed(glyph);
+        if (glyph->texture != texture || rotated != transformed) {
+            /*
+             * Different texture id
+             * Find its unit in the current batch or give it a free one.
+             * Setup a new render batch when there are none left,
+             * or the glyph needs its transform and the batch has none
+             * or the other way around
+             */
+            texture = glyph->texture;
+            const GLuint *bound = &batchTextures[batch->firstTexture];
+            for (slot = 0; slot < (GLuint)batch->numTextures; slot++) {
+                if (bound[slot] == texture) break;
+            }
+
+            if (slot == (GLuint)__fl_texture_units || rotated != transformed) {
+                int first = batch->firstTexture + batch->numTextures;
+                batch = &batches[++crb];
+                batch->offset = i;
+                batch->numGlyphs = 0;
+                batch->firstTexture = first;
+                batch->numTextures = 0;
+                batch->firstTransform = rotated ? numTransforms : -1;
+                transformed = rotated;
+                slot = 0;
+            }
+            if (slot == (GLuint)batch->numTextures) {
+                batchTextures[batch->firstTexture + slot] = texture;
+                batch->numTextures++;
+            }
+        }
+        batch->numGlyphs++;
+
+        fl_glyph_write(glyph, __fl_indirect ?
+            batch->firstTexture + slot : slot, data, i);
+        if (rotated) transforms[numTransforms++] = glyph->transform;
+    }
+
+    return crb + 1;
+}
+
+#ifndef FL_HEADLESS
+
+static unsigned int __fl_vao;
+static unsigned int __fl_vbo;
+static unsigned int __fl_ibo;
+static unsigned int __fl_shader;
+
+static const char *__fl_vertex_shader =
+"#version 150 \n"
+"in vec2 position; \n"
+"in vec2 uv; \n"
+"in vec4 color; \n"
+"in uint slot; \n"
+"uniform mat4 pr_matrix = mat4(1.0); \n"
+"out vec2 vsUV; \n"
+"out vec4 vsColor; \n"
+"flat out uint vsSlot; \n"
+"void main() { \n"
+"    gl_Position = pr_matrix * vec4(position, 0.0, 1.0); \n"
+"    vsUV = uv; \n"
+"    vsColor = color; \n"
+"    vsSlot = slot; \n"
+"} \n";
+
+/*
+ * Vertex shader of the instanced mode.
+ * There are no vertices, just one instance per glyph drawn as a
+ * 4 vertex triangle strip. The corner comes from gl_VertexID:
+ * 0 -> topLeft, 1 -> bottomLeft, 2 -> topRight, 3 -> bottomRight
+ * transform is the origin and the rotation of the glyph. Only the change
+ * the rotation makes is added, so unrotated glyphs land exactly where
+ * the vertex mode puts them.
+ */
+static const char *__fl_instanced_vertex_shader =
+"#version 150 \n"
+"in vec4 destRect; \n"
+"in vec4 srcRect; \n"
+"in vec4 color; \n"
+"in uint slot; \n"
+"in vec3 transform; \n"
+"uniform mat4 pr_matrix = mat4(1.0); \n"
+"out vec2 vsUV; \n"
+"out vec4 vsColor; \n"
+"flat out uint vsSlot; \n"
+"void main() { \n"
+"    vec2 corner = vec2(gl_VertexID >> 1, gl_VertexID & 1); \n"
+"    vec2 offset = corner * destRect.zw - transform.xy; \n"
+"    float c = cos(transform.z); \n"
+"    float s = sin(transform.z); \n"
+"    vec2 rotated = vec2(c * offset.x - s * offset.y, \n"
+"        s * offset.x + c * offset.y); \n"
+"    vec2 position = destRect.xy + corner * destRect.zw + \n"
+"        (rotated - offset); \n"
+"    gl_Position = pr_matrix * vec4(position, 0.0, 1.0); \n"
+"    vsUV = srcRect.xy + corner * srcRect.zw; \n"
+"    vsColor = color; \n"
+"    vsSlot = slot; \n"
+"} \n";
+
+/*
+ * GLSL 1.50 can only index sampler arrays with constant expressions
+ * so the texture unit is picked with a branch per slot.
+ * The derivatives are taken before branching, where they are still defined.
+ */
+static const char *__fl_fragment_shader =
+"#version 150 \n"
+"out vec4 outColor; \n"
+"uniform sampler2D textures[16]; \n"
+"in vec2 vsUV; \n"
+"in vec4 vsColor; \n"
+"flat in uint vsSlot; \n"
+"#define FL_SAMPLE(i) textureGrad(textures[i], vsUV, dx, dy) \n"
+"void main() { \n"
+"    vec2 dx = dFdx(vsUV); \n"
+"    vec2 dy = dFdy(vsUV); \n"
+"    vec4 texel; \n"
+"    switch (vsSlot) { \n"
+"    case 0u: texel = FL_SAMPLE(0); break; \n"
+"    case 1u: texel = FL_SAMPLE(1); break; \n"
+"    case 2u: texel = FL_SAMPLE(2); break; \n"
+"    case 3u: texel = FL_SAMPLE(3); break; \n"
+"    case 4u: texel = FL_SAMPLE(4); break; \n"
+"    case 5u: texel = FL_SAMPLE(5); break; \n"
+"    case 6u: texel = FL_SAMPLE(6); break; \n"
+"    case 7u: texel = FL_SAMPLE(7); break; \n"
+"    case 8u: texel = FL_SAMPLE(8); break; \n"
+"    case 9u: texel = FL_SAMPLE(9); break; \n"
+"    case 10u: texel = FL_SAMPLE(10); break; \n"
+"    case 11u: texel = FL_SAMPLE(11); break; \n"
+"    case 12u: texel = FL_SAMPLE(12); break; \n"
+"    case 13u: texel = FL_SAMPLE(13); break; \n"
+"    case 14u: texel = FL_SAMPLE(14); break; \n"
+"    default: texel = FL_SAMPLE(15); break; \n"
+"    } \n"
+"    outColor = texel * vsColor; \n"
+"} \n";
+
+/*
+ * Fragment shader of the indirect mode.
+ * Every batch texture is a bindless handle in the handles buffer
+ * and slot indexes it directly, so nothing is bound between batches.
+ * slot is the same for the whole quad so no branching is needed either.
+ */
+static const char *__fl_bindless_fragment_shader =
+"#version 430 \n"
+"#extension GL_ARB_bindless_texture : require \n"
+"out vec4 outColor; \n"
+"layout(std430, binding = 0) readonly buffer flTextureHandles { \n"
+"    uvec2 handles[]; \n"
+"}; \n"
+"in vec2 vsUV; \n"
+"in vec4 vsColor; \n"
+"flat in uint vsSlot; \n"
+"void main() { \n"
+"    outColor = texture(sampler2D(handles[vsSlot]), vsUV) * vsColor; \n"
+"} \n";
+
+/*
+ * The indirect draw commands, laid out exactly as OpenGL reads them
+ * from the GL_DRAW_INDIRECT_BUFFER. One per render batch.
+ */
+typedef struct flDrawElementsCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+} flDrawElementsCommand_t;
+
+typedef struct flDrawArraysCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint first;
+	GLuint baseInstance;
+} flDrawArraysCommand_t;
+
+/*
+ * Streaming mode.
+ * The vertex buffer is split in __fl_stream_frames regions of
+ * __fl_stream_regionGlyphs glyphs each and stays mapped for its whole life.
+ * Every flRendererEnd writes the vertices straight into the next region
+ * and fences it. A region is only reused once its fence has signaled.
+ * The staging __fl_vertexData is not used at all in this mode.
+ * Quad indices are built for __fl_indices_capacity glyphs.
+ */
+static int __fl_stream_frames = 0;
+static int __fl_stream_frame = 0;
+static int __fl_stream_regionGlyphs = 0;
+static unsigned char *__fl_stream_data;
+static GLsync __fl_stream_fences[FL_RENDERER_MAX_STREAMING_FRAMES];
+static int __fl_indices_capacity = 0;
+
+/*
+ * Indirect mode.
+ * The draw commands of the batches and the handles of their textures
+ * are built here and uploaded to __fl_indirect_buffer and
+ * __fl_handle_buffer right before the draw.
+ * Retained layers draw through them as well so they grow on demand.
+ */
+static unsigned int __fl_indirect_buffer;
+static unsigned int __fl_handle_buffer;
+static unsigned char *__fl_drawCommands;
+static int __fl_drawCommands_capacity = 0;
+static GLuint64 *__fl_textureHandles;
+static int __fl_textureHandles_capacity = 0;
+
+/*
+ * The resident bindless handle of every texture drawn in indirect mode,
+ * indexed by the texture id. 0 where there is none yet.
+ * Released with flRendererReleaseTexture.
+ */
+static GLuint64 *__fl_residentHandles;
+static GLuint __fl_residentHandles_capacity = 0;
+
+/*
+ * What the OpenGL backend issued since the last flRendererEnd.
+ * Every frame is timed with its own query. Only the oldest one,
+ * FL_RENDERER_GPU_TIMER_FRAMES back, is read and only when its
+ * result is available, the renderer never waits for one.
+ */
+static int __fl_gl_drawCalls = 0;
+static int __fl_gl_textureBinds = 0;
+static bool __fl_timer = false;
+static bool __fl_timer_running = false;
+static int __fl_timer_frame = 0;
+static double __fl_timer_result = -1.0;
+static GLuint __fl_timer_queries[FL_RENDERER_GPU_TIMER_FRAMES];
+static bool __fl_timer_pending[FL_RENDERER_GPU_TIMER_FRAMES];
+
+/*
+ * The OpenGL state the backend last set, so binding what is already bound
+ * can be skipped. FL_GL_UNKNOWN means it has to be set anyway.
+ * It is only trusted until the end of the frame, user code may change
+ * it in between. The projection is uploaded to the program when it
+ * is bound and the matrix changed since the last upload.
+ */
+#define FL_GL_UNKNOWN 0xFFFFFFFFu
+static GLuint __fl_bound_program = FL_GL_UNKNOWN;
+static GLuint __fl_bound_vao = FL_GL_UNKNOWN;
+static GLuint __fl_bound_buffer = FL_GL_UNKNOWN;
+static GLuint __fl_active_unit = FL_GL_UNKNOWN;
+static GLuint __fl_bound_textures[FL_RENDERER_MAX_TEXTURE_UNITS];
+static GLint __fl_pr_matrix_location = -1;
+static flMat4_t __fl_projection;
+static bool __fl_projection_set = false;
+static bool __fl_projection_dirty = false;
+
+static void fl_gl_invalidate()
+{
+    __fl_bound_program = FL_GL_UNKNOWN;
+    __fl_bound_vao = FL_GL_UNKNOWN;
+    __fl_bound_buffer = FL_GL_UNKNOWN;
+    __fl_active_unit = FL_GL_UNKNOWN;
+
+    int i;
+    for (i = 0; i < FL_RENDERER_MAX_TEXTURE_UNITS; i++)
+        __fl_bound_textures[i] = FL_GL_UNKNOWN;
+}
+
+static void fl_gl_bind_vertex_array(GLuint vao)
+{
+    if (__fl_bound_vao == vao) return;
+    glBindVertexArray(vao);
+    __fl_bound_vao = vao;
+}
+
+static void fl_gl_bind_array_buffer(GLuint buffer)
+{
+    if (__fl_bound_buffer == buffer) return;
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    __fl_bound_buffer = buffer;
+}
+
+static void fl_gl_bind_texture(int unit, GLuint texture)
+{
+    if (__fl_bound_textures[unit] == texture) return;
+    if (__fl_active_unit != (GLuint)unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        __fl_active_unit = unit;
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    __fl_bound_textures[unit] = texture;
+    __fl_gl_textureBinds++;
+}
+
+/*
+ * Use the shader program with the latest projection
+ */
+static void fl_gl_use_program()
+{
+    if (__fl_bound_program != __fl_shader) {
+        glUseProgram(__fl_shader);
+        __fl_bound_program = __fl_shader;
+    }
+    if (__fl_projection_dirty) {
+        glUniformMatrix4fv(__fl_pr_matrix_location, 1, false,
+            __fl_projection.data);
+        __fl_projection_dirty = false;
+    }
+}
+
+/*
+ * Fill the index buffer bound to the current vertex array with the
+ * indices of glyphs quads.
+ * Every glyph is a quad of 4 vertices in the order
+ * topLeft, bottomLeft, bottomRight, topRight
+ * so the indices never change. They are only rebuilt when the
+ * glyph capacity grows.
+ */
+static void fl_renderer_build_indices(int glyphs)
+{
+    GLuint *indices = (GLuint *)malloc(sizeof(GLuint) * FL_GLYPH_INDICES * glyphs);
+    FLASSERT(indices != NULL);
+    if (indices == NULL) return;
+
+    int i;
+    for (i = 0; i < glyphs; i++) {
+        indices[i * 6 + 0] = i * 4 + 0;
+        indices[i * 6 + 1] = i * 4 + 1;
+        indices[i * 6 + 2] = i * 4 + 2;
+        indices[i * 6 + 3] = i * 4 + 2;
+        indices[i * 6 + 4] = i * 4 + 3;
+        indices[i * 6 + 5] = i * 4 + 0;
+    }
+
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+        sizeof(GLuint) * FL_GLYPH_INDICES * glyphs, indices, GL_STATIC_DRAW);
+    free(indices);
+
+    __fl_indices_capacity = glyphs;
+}
+
+/*
+ * Point the vertex attributes of the current vertex array
+ * to the buffer bound to GL_ARRAY_BUFFER, starting offset bytes in.
+ * The instanced mode re-points them for every batch since it has no
+ * base vertex to start the draw from.
+ */
+static void fl_renderer_setup_attributes(size_t offset)
+{
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glEnableVertexAttribArray(3);
+
+    if (__fl_instanced) {
+        glVertexAttribPointer(0, 4, GL_FLOAT, false, FL_INSTANCE_SIZE,
+            (const void *)offset);
+
+        glVertexAttribPointer(1, 4, GL_FLOAT, false, FL_INSTANCE_SIZE,
+            (const void *)(offset + sizeof(flVec4_t)));
+
+        glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, true, FL_INSTANCE_SIZE,
+            (const void *)(offset + sizeof(flVec4_t) * 2));
+
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, FL_INSTANCE_SIZE,
+            (const void *)(offset + sizeof(flVec4_t) * 2 + sizeof(GLuint)));
+
+        /*
+         * Below OpenGL 3.3 the divisor only comes with ARB_instanced_arrays
+         */
+        int attribute;
+        for (attribute = 0; attribute < 5; attribute++) {
+            if (GLEW_VERSION_3_3)
+                glVertexAttribDivisor(attribute, 1);
+            else
+                glVertexAttribDivisorARB(attribute, 1);
+        }
+        return;
+    }
+
+    if (__fl_compact) {
+        glVertexAttribPointer(0, 2, GL_SHORT, false, FL_COMPACT_VERTEX_SIZE,
+            (const void *)offset);
+
+        glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, true,
+            FL_COMPACT_VERTEX_SIZE,
+            (const void *)(offset + sizeof(GLshort) * 2));
+
+        glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, true,
+            FL_COMPACT_VERTEX_SIZE,
+            (const void *)(offset + sizeof(GLshort) * 4));
+
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, FL_COMPACT_VERTEX_SIZE,
+            (const void *)(offset + sizeof(GLshort) * 4 + sizeof(GLuint)));
+        return;
+    }
+
+    glVertexAttribPointer(0, 2, GL_FLOAT, false, FL_VERTEX_SIZE,
+        (const void *)offset);
+
+    glVertexAttribPointer(1, 2, GL_FLOAT, false, FL_VERTEX_SIZE,
+        (const void *)(offset + sizeof(flVec2_t)));
+
+    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, true, FL_VERTEX_SIZE,
+        (const void *)(offset + sizeof(flVec2_t) * 2));
+
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, FL_VERTEX_SIZE,
+        (const void *)(offset + sizeof(flVec2_t) * 2 + sizeof(GLuint)));
+}
+
+/*
+ * Point the transform attribute of the instanced mode to the transforms
+ * starting offset bytes in, or give every instance none when offset is -1.
+ * Unrotated instances leave it at (0, 0, 0) this way and take no room.
+ */
+static void fl_renderer_setup_transforms(GLintptr offset)
+{
+    if (offset < 0) {
+        glDisableVertexAttribArray(4);
+        glVertexAttrib3f(4, 0.0f, 0.0f, 0.0f);
+        return;
+    }
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(4, 3, GL_FLOAT, false, FL_TRANSFORM_SIZE,
+        (const void *)offset);
+}
+
+/*
+ * Block until the GPU is done reading the given streaming region
+ */
+static void fl_stream_wait(int frame)
+{
+    GLsync fence = __fl_stream_fences[frame];
+    if (fence == 0) return;
+
+    GLenum status;
+    do {
+        status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    } while (status == GL_TIMEOUT_EXPIRED);
+
+    glDeleteSync(fence);
+    __fl_stream_fences[frame] = 0;
+}
+
+/*
+ * (Re)create the persistently mapped vertex buffer with room for
+ * glyphs glyphs per region.
+ * Buffer storage is immutable so growing means a brand new buffer.
+ * The vertex array has to be bound since the attributes are re-pointed.
+ */
+static void fl_stream_create(int glyphs)
+{
+    int i;
+    for (i = 0; i < __fl_stream_frames; i++) fl_stream_wait(i);
+
+    /*
+     * Deleting the bound buffer unbinds it
+     */
+    if (__fl_vbo != 0) {
+        glDeleteBuffers(1, &__fl_vbo);
+        if (__fl_bound_buffer == __fl_vbo) __fl_bound_buffer = 0;
+    }
+    glGenBuffers(1, &__fl_vbo);
+    FLASSERT(__fl_vbo != 0);
+    fl_gl_bind_array_buffer(__fl_vbo);
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+        GL_MAP_COHERENT_BIT;
+    GLsizeiptr size = (GLsizeiptr)__fl_glyph_space * glyphs *
+        __fl_stream_frames;
+
+    glBufferStorage(GL_ARRAY_BUFFER, size, (const void *)0, flags);
+    __fl_stream_data = (unsigned char *)glMapBufferRange(GL_ARRAY_BUFFER, 0,
+        size, flags);
+    FLASSERT(__fl_stream_data != NULL);
+
+    __fl_stream_regionGlyphs = glyphs;
+    __fl_stream_frame = 0;
+
+    fl_renderer_setup_attributes(0);
+}
+
+/*
+ * Resident bindless handle of texture.
+ * It is looked up and made resident the first time the texture is
+ * drawn and cached by its id from then on.
+ * Returns 0 when the cache cannot grow.
+ */
+static GLuint64 fl_texture_handle(GLuint texture)
+{
+    if (texture >= __fl_residentHandles_capacity) {
+        GLuint capacity = __fl_residentHandles_capacity * 2;
+        if (capacity <= texture) capacity = texture + 1;
+
+        void *handles = realloc(__fl_residentHandles,
+            sizeof(GLuint64) * capacity);
+        if (handles == NULL) return 0;
+        __fl_residentHandles = (GLuint64 *)handles;
+        memset(__fl_residentHandles + __fl_residentHandles_capacity, 0,
+            sizeof(GLuint64) * (capacity - __fl_residentHandles_capacity));
+        __fl_residentHandles_capacity = capacity;
+    }
+
+    GLuint64 handle = __fl_residentHandles[texture];
+    if (handle == 0) {
+        handle = glGetTextureHandleARB(texture);
+        if (!glIsTextureHandleResidentARB(handle))
+            glMakeTextureHandleResidentARB(handle);
+        __fl_residentHandles[texture] = handle;
+    }
+    return handle;
+}
+
+/*
+ * Make every cached handle non resident and forget them
+ */
+static void fl_texture_handles_release()
+{
+    GLuint i;
+    for (i = 0; i < __fl_residentHandles_capacity; i++) {
+        if (__fl_residentHandles[i] != 0)
+            glMakeTextureHandleNonResidentARB(__fl_residentHandles[i]);
+    }
+    free(__fl_residentHandles);
+    __fl_residentHandles = NULL;
+    __fl_residentHandles_capacity = 0;
+}
+
+/*
+ * Grow the arrays the indirect draw is built in, to fit
+ * numBatches commands and numTextures handles.
+ * Returns 0 on success.
+ */
+static int fl_indirect_reserve(int numBatches, int numTextures)
+{
+    if (numBatches > __fl_drawCommands_capacity) {
+        void *commands = realloc(__fl_drawCommands,
+            sizeof(flDrawElementsCommand_t) * numBatches);
+        if (commands == NULL) return -1;
+        __fl_drawCommands = (unsigned char *)commands;
+        __fl_drawCommands_capacity = numBatches;
+    }
+
+    if (numTextures > __fl_textureHandles_capacity) {
+        void *handles = realloc(__fl_textureHandles,
+            sizeof(GLuint64) * numTextures);
+        if (handles == NULL) return -1;
+        __fl_textureHandles = (GLuint64 *)handles;
+        __fl_textureHandles_capacity = numTextures;
+    }
+
+    return 0;
+}
+
+/*
+ * Write a draw command per batch and submit them all at once.
+ * The slots of the glyphs already index batchTextures as a whole,
+ * the handles buffer is laid out the same way.
+ * Batches of rotated instances are drawn on their own, between
+ * the multi draws of the ones around them.
+ * Returns 0 on success. Nothing is drawn on failure.
+ */
+static int fl_renderer_draw_indirect(const flRenderBatch_t *batches,
+        int numBatches, const GLuint *batchTextures, int baseGlyph, int glyphs)
+{
+    const flRenderBatch_t *last = &batches[numBatches - 1];
+    int numTextures = last->firstTexture + last->numTextures;
+    if (fl_indirect_reserve(numBatches, numTextures) != 0) return -1;
+
+    int i;
+    for (i = 0; i < numTextures; i++) {
+        __fl_textureHandles[i] = fl_texture_handle(batchTextures[i]);
+        if (__fl_textureHandles[i] == 0) return -1;
+    }
+
+    /*
+     * The instances of a batch are reached through baseInstance
+     * so the attributes point to the start of the data, once
+     */
+    size_t base = (size_t)__fl_glyph_space * baseGlyph;
+    size_t commandSize;
+    if (__fl_instanced) {
+        flDrawArraysCommand_t *commands =
+            (flDrawArraysCommand_t *)__fl_drawCommands;
+        for (i = 0; i < numBatches; i++) {
+            commands[i].count = 4;
+            commands[i].instanceCount = batches[i].numGlyphs;
+            commands[i].first = 0;
+            commands[i].baseInstance = batches[i].offset;
+        }
+        commandSize = sizeof(flDrawArraysCommand_t);
+        fl_renderer_setup_attributes(base);
+        fl_renderer_setup_transforms(-1);
+    }
+    else {
+        flDrawElementsCommand_t *commands =
+            (flDrawElementsCommand_t *)__fl_drawCommands;
+        for (i = 0; i < numBatches; i++) {
+            commands[i].count = batches[i].numGlyphs * FL_GLYPH_INDICES;
+            commands[i].instanceCount = 1;
+            commands[i].firstIndex = batches[i].offset * FL_GLYPH_INDICES;
+            commands[i].baseVertex = baseGlyph * FL_GLYPH_VERTICES;
+            commands[i].baseInstance = 0;
+        }
+        commandSize = sizeof(flDrawElementsCommand_t);
+    }
+
+    /*
+     * Both buffers are tiny next to the vertices. Orphan and upload them
+     */
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, __fl_handle_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint64) * numTextures,
+        __fl_textureHandles, GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, __fl_handle_buffer);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, __fl_indirect_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, commandSize * numBatches,
+        __fl_drawCommands, GL_STREAM_DRAW);
+
+    if (!__fl_instanced) {
+        __fl_gl_drawCalls++;
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+            (const void *)0, numBatches, 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        return 0;
+    }
+
+    /*
+     * Every run of unrotated batches is a single multi draw.
+     * The transform attribute cannot follow baseInstance, the transforms
+     * are packed, so rotated batches re-point the attributes and draw
+     */
+    int first = 0;
+    for (i = 0; i <= numBatches; i++) {
+        if (i < numBatches && batches[i].firstTransform < 0) continue;
+
+        if (i > first) {
+            __fl_gl_drawCalls++;
+            glMultiDrawArraysIndirect(GL_TRIANGLE_STRIP,
+                (const void *)(commandSize * first), i - first, 0);
+        }
+        if (i == numBatches) break;
+
+        const flRenderBatch_t *batch = &batches[i];
+        fl_renderer_setup_attributes(base +
+            (size_t)__fl_glyph_stride * batch->offset);
+        fl_renderer_setup_transforms((GLintptr)(base +
+            (size_t)__fl_glyph_stride * glyphs +
+            FL_TRANSFORM_SIZE * batch->firstTransform));
+        __fl_gl_drawCalls++;
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, batch->numGlyphs);
+
+        fl_renderer_setup_attributes(base);
+        fl_renderer_setup_transforms(-1);
+        first = i + 1;
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    return 0;
+}
+
+/*
+ * Bind the textures of every batch and draw it.
+ * The vertex array and the buffer the batches were written to
+ * have to be bound. baseGlyph is where the data of the glyphs glyphs
+ * starts in that buffer, in glyphs of __fl_glyph_space bytes.
+ */
+static void fl_renderer_draw_batches(const flRenderBatch_t *batches,
+        int numBatches, const GLuint *batchTextures, int baseGlyph, int glyphs)
+{
+    if (__fl_indirect) {
+        int err = fl_renderer_draw_indirect(batches, numBatches,
+            batchTextures, baseGlyph, glyphs);
+        FLASSERT(err == 0);
+        (void)err;
+        return;
+    }
+
+    /*
+     * Iterate through the render batches and draw them
+     */
+    int i;
+    for (i = 0; i < numBatches; i++) {
+        const flRenderBatch_t *batch = &batches[i];
+
+        int unit;
+        for (unit = 0; unit < batch->numTextures; unit++) {
+            fl_gl_bind_texture(unit, batchTextures[batch->firstTexture + unit]);
+        }
+        __fl_gl_drawCalls++;
+
+        if (__fl_instanced) {
+            size_t base = (size_t)__fl_glyph_space * baseGlyph;
+            fl_renderer_setup_attributes(base +
+                (size_t)__fl_glyph_stride * batch->offset);
+            fl_renderer_setup_transforms(batch->firstTransform < 0 ? -1 :
+                (GLintptr)(base + (size_t)__fl_glyph_stride * glyphs +
+                FL_TRANSFORM_SIZE * batch->firstTransform));
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, batch->numGlyphs);
+        }
+        else {
+            glDrawElementsBaseVertex(GL_TRIANGLES,
+                batch->numGlyphs * FL_GLYPH_INDICES, GL_UNSIGNED_INT,
+                (const void *)(sizeof(GLuint) * FL_GLYPH_INDICES * batch->offset),
+                baseGlyph * FL_GLYPH_VERTICES);
+        }
+    }
+}
+
+/*
+ * The program cache file is this header followed by length bytes of
+ * the program binary. key identifies the shader sources and the driver
+ * the binary was made with.
+ */
+typedef struct flProgramCacheHeader {
+	char magic[4];
+	GLuint format;
+	GLuint64 key;
+	GLuint length;
+} flProgramCacheHeader_t;
+
+#define FL_PROGRAM_CACHE_MAGIC "FLP1"
+
+/*
+ * 64 bit FNV-1a of str, continued from hash
+ */
+static GLuint64 fl_hash(GLuint64 hash, const char *str)
+{
+    if (str == NULL) return hash;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * The key of the program built from the given sources on this driver
+ */
+static GLuint64 fl_program_key(const char *vertexSource,
+        const char *fragmentSource)
+{
+    GLuint64 hash = 0xcbf29ce484222325ULL;
+    hash = fl_hash(hash, vertexSource);
+    hash = fl_hash(hash, fragmentSource);
+    hash = fl_hash(hash, (const char *)glGetString(GL_VENDOR));
+    hash = fl_hash(hash, (const char *)glGetString(GL_RENDERER));
+    hash = fl_hash(hash, (const char *)glGetString(GL_VERSION));
+    return hash;
+}
+
+/*
+ * Load the program binary cached at path into program.
+ * Returns 0 on success. Fails when the file is missing, was made for
+ * other sources or another driver or the driver rejects it,
+ * program is left unlinked then.
+ */
+static bool fl_program_load(GLuint program, const char *path, GLuint64 key)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return -1;
+
+    flProgramCacheHeader_t header;
+    void *binary = NULL;
+    bool err = fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, FL_PROGRAM_CACHE_MAGIC, 4) != 0 ||
+        header.key != key || header.length == 0;
+    if (!err) {
+        binary = malloc(header.length);
+        err = binary == NULL ||
+            fread(binary, 1, header.length, file) != header.length;
+    }
+    fclose(file);
+
+    if (!err) {
+        glProgramBinary(program, header.format, binary, (GLsizei)header.length);
+        GLint status = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        err = status != GL_TRUE;
+    }
+    free(binary);
+    return err;
+}
+
+/*
+ * Write the binary of the linked program to path.
+ * Returns 0 on success.
+ */
+static bool fl_program_save(GLuint program, const char *path, GLuint64 key)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return -1;
+
+    void *binary = malloc((size_t)length);
+    if (binary == NULL) return -1;
+
+    flProgramCacheHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FL_PROGRAM_CACHE_MAGIC, 4);
+    header.key = key;
+
+    GLenum format = 0;
+    GLsizei written = 0;
+    glGetProgramBinary(program, length, &written, &format, binary);
+    header.format = format;
+    header.length = (GLuint)written;
+
+    bool err = written <= 0;
+    if (!err) {
+        FILE *file = fopen(path, "wb");
+        err = file == NULL;
+        if (!err) {
+            err = fwrite(&header, sizeof(header), 1, file) != 1 ||
+                fwrite(binary, 1, (size_t)written, file) != (size_t)written;
+            err = fclose(file) != 0 || err;
+        }
+    }
+    free(binary);
+    return err;
+}
+
+/*
+ * Start timing the frame with the first thing drawn in it
+ */
+static void fl_gl_timer_start()
+{
+    if (!__fl_timer || __fl_timer_running) return;
+
+    glBeginQuery(GL_TIME_ELAPSED, __fl_timer_queries[__fl_timer_frame]);
+    __fl_timer_running = true;
+}
+
+/*
+ * Grow capacity by doubling until it fits needed
+ */
+static int fl_gl_grow(int capacity, int needed)
+{
+    if (capacity < 1) capacity = 1;
+    while (capacity < needed) capacity *= 2;
+    return capacity;
+}
+
+/*
+ * Turn off the modes the driver cannot do
+ */
+static void fl_gl_configure(void *user, flRendererConfig_t *config)
+{
+    (void)user;
+
+    config->instanced = config->instanced &&
+        (GLEW_VERSION_3_3 || GLEW_ARB_instanced_arrays);
+
+    /*
+     * The bindless fragment shader reads the handles from a shader storage
+     * buffer, GLSL 4.30, so the extensions alone are not enough
+     */
+    config->multiDrawIndirect = config->multiDrawIndirect &&
+        GLEW_ARB_bindless_texture && GLEW_VERSION_4_3;
+
+    /*
+     * Use the persistently mapped ring buffer when the driver has
+     * buffer storage. Fall back to orphaning otherwise
+     */
+    if (!(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage))
+        config->streamingFrames = 0;
+    if (config->streamingFrames > FL_RENDERER_MAX_STREAMING_FRAMES)
+        config->streamingFrames = FL_RENDERER_MAX_STREAMING_FRAMES;
+
+    config->gpuTimer = config->gpuTimer &&
+        (GLEW_VERSION_3_3 || GLEW_ARB_timer_query);
+
+    if (!(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary))
+        config->programCache = NULL;
+}
+
+/*
+ * Create and set up the shader, the vertex array and the buffers
+ */
+static bool fl_gl_init(void *user, const flRendererConfig_t *config)
+{
+    (void)user;
+    __fl_stream_frames = config->streamingFrames;
+    fl_gl_invalidate();
+
+    __fl_timer = config->gpuTimer;
+    if (__fl_timer) {
+        glGenQueries(FL_RENDERER_GPU_TIMER_FRAMES, __fl_timer_queries);
+        memset(__fl_timer_pending, 0, sizeof(__fl_timer_pending));
+        __fl_timer_frame = 0;
+        __fl_timer_result = -1.0;
+    }
+
+    bool err = 0;
+
+    __fl_shader = glCreateProgram();
+    FLASSERT(__fl_shader != 0);
+
+    const char *vertexSource = config->instanced ?
+        __fl_instanced_vertex_shader : __fl_vertex_shader;
+    const char *fragmentSource = config->multiDrawIndirect ?
+        __fl_bindless_fragment_shader : __fl_fragment_shader;
+
+    /*
+     * A cached binary of the same sources from the same driver
+     * is already linked, attribute locations included
+     */
+    GLuint64 key = 0;
+    bool cached = false;
+    if (config->programCache != NULL) {
+        key = fl_program_key(vertexSource, fragmentSource);
+        cached = fl_program_load(__fl_shader, config->programCache, key) == 0;
+    }
+
+    if (!cached) {
+        err = flShaderAttach(__fl_shader, vertexSource, GL_VERTEX_SHADER);
+        FLASSERT(err == 0);
+        if (err != 0) return err;
+
+        err = flShaderAttach(__fl_shader, fragmentSource, GL_FRAGMENT_SHADER);
+        FLASSERT(err == 0);
+        if (err != 0) return err;
+
+        /*
+         * The attribute locations have to be fixed before linking,
+         * fl_renderer_setup_attributes relies on them
+         */
+        if (config->instanced) {
+            glBindAttribLocation(__fl_shader, 0, "destRect");
+            glBindAttribLocation(__fl_shader, 1, "srcRect");
+            glBindAttribLocation(__fl_shader, 4, "transform");
+        }
+        else {
+            glBindAttribLocation(__fl_shader, 0, "position");
+            glBindAttribLocation(__fl_shader, 1, "uv");
+        }
+        glBindAttribLocation(__fl_shader, 2, "color");
+        glBindAttribLocation(__fl_shader, 3, "slot");
+
+        if (config->programCache != NULL) {
+            glProgramParameteri(__fl_shader,
+                GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+
+        err = flShaderLink(__fl_shader);
+        FLASSERT(err == 0);
+        if (err != 0) return err;
+
+        /*
+         * Failing to write the cache only costs the next run a compile
+         */
+        if (config->programCache != NULL)
+            fl_program_save(__fl_shader, config->programCache, key);
+    }
+
+    glUseProgram(__fl_shader);
+    __fl_pr_matrix_location = glGetUniformLocation(__fl_shader, "pr_matrix");
+    FLASSERT(__fl_pr_matrix_location != -1);
+    __fl_projection_set = false;
+    __fl_projection_dirty = false;
+
+    /*
+     * Slot i of the fragment shader samples from texture unit i.
+     * The indirect mode has no units
+     */
+    if (config->multiDrawIndirect) {
+        if (__fl_indirect_buffer == 0) glGenBuffers(1, &__fl_indirect_buffer);
+        if (__fl_handle_buffer == 0) glGenBuffers(1, &__fl_handle_buffer);
+        FLASSERT(__fl_indirect_buffer != 0 && __fl_handle_buffer != 0);
+    }
+    else {
+        GLint units[FL_RENDERER_MAX_TEXTURE_UNITS];
+        int i;
+        for (i = 0; i < FL_RENDERER_MAX_TEXTURE_UNITS; i++) units[i] = i;
+        glUniform1iv(glGetUniformLocation(__fl_shader, "textures"),
+            FL_RENDERER_MAX_TEXTURE_UNITS, units);
+    }
+
+    if (__fl_vao == 0) glGenVertexArrays(1, &__fl_vao);
+    FLASSERT(__fl_vao != 0);
+    glBindVertexArray(__fl_vao);
+
+    if (__fl_stream_frames > 0) {
+        fl_stream_create(config->maxGlyphs);
+    }
+    else {
+        if (__fl_vbo == 0) glGenBuffers(1, &__fl_vbo);
+        FLASSERT(__fl_vbo != 0);
+        glBindBuffer(GL_ARRAY_BUFFER, __fl_vbo);
+        fl_renderer_setup_attributes(0);
+    }
+
+    /*
+     * The quad indices are built once and stay bound to the vertex array.
+     * Instances make their quads in the vertex shader and need none
+     */
+    if (!config->instanced) {
+        if (__fl_ibo == 0) glGenBuffers(1, &__fl_ibo);
+        FLASSERT(__fl_ibo != 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, __fl_ibo);
+        fl_renderer_build_indices(config->maxGlyphs);
+    }
+
+    /*
+     * Unbind the vertex array first. The element array binding is part of
+     * its state and has to stay there
+     */
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    fl_gl_invalidate();
+    return err;
+}
+
+static void fl_gl_set_projection(void *user, const flMat4_t *pr_matrix)
+{
+    (void)user;
+    if (__fl_projection_set &&
+            memcmp(&__fl_projection, pr_matrix, sizeof(flMat4_t)) == 0)
+        return;
+
+    __fl_projection = *pr_matrix;
+    __fl_projection_set = true;
+    __fl_projection_dirty = true;
+}
+
+/*
+ * In streaming mode the glyph data goes straight into the mapped region
+ * of this frame, once the GPU is done with it.
+ * The buffer is recreated first if the glyphs no longer fit a region.
+ */
+static unsigned char *fl_gl_map(void *user, int glyphs)
+{
+    (void)user;
+    if (glyphs > __fl_stream_regionGlyphs) {
+        fl_gl_bind_vertex_array(__fl_vao);
+        fl_stream_create(fl_gl_grow(__fl_stream_regionGlyphs, glyphs));
+    }
+    fl_stream_wait(__fl_stream_frame);
+
+    int baseGlyph = __fl_stream_frame * __fl_stream_regionGlyphs;
+    return __fl_stream_data + (size_t)__fl_glyph_space * baseGlyph;
+}
+
+static void fl_gl_draw(void *user, const unsigned char *data, int glyphs,
+        const flRenderBatch_t *batches, int numBatches,
+        const GLuint *batchTextures)
+{
+    (void)user;
+    fl_gl_timer_start();
+    fl_gl_use_program();
+    fl_gl_bind_vertex_array(__fl_vao);
+    fl_gl_bind_array_buffer(__fl_vbo);
+
+    /*
+     * The glyph storage grew since the index buffer was built
+     */
+    if (!__fl_instanced && glyphs > __fl_indices_capacity)
+        fl_renderer_build_indices(fl_gl_grow(__fl_indices_capacity, glyphs));
+
+    int baseGlyph = 0;
+    if (__fl_stream_frames == 0) {
+        /*
+         * Orphan the buffer. Faster this way
+         */
+        GLsizeiptr size = (GLsizeiptr)fl_glyph_data_size(glyphs, batches,
+            numBatches);
+        glBufferData(GL_ARRAY_BUFFER, size, (const void *)0, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+    }
+    else {
+        baseGlyph = __fl_stream_frame * __fl_stream_regionGlyphs;
+    }
+
+    fl_renderer_draw_batches(batches, numBatches, batchTextures, baseGlyph,
+        glyphs);
+
+    /*
+     * Guard the region until the GPU has drawn from it and move on
+     */
+    if (__fl_stream_frames > 0) {
+        __fl_stream_fences[__fl_stream_frame] =
+            glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        __fl_stream_frame = (__fl_stream_frame + 1) % __fl_stream_frames;
+    }
+}
+
+/*
+ * The buffer of a retained layer. It has its own vertex array pointing
+ * to its own vertex buffer and sharing the renderer's quad indices
+ */
+typedef struct flGLBuffer {
+	GLuint vao;
+	GLuint vbo;
+} flGLBuffer_t;
+
+static void *fl_gl_create_buffer(void *user)
+{
+    (void)user;
+    flGLBuffer_t *buffer = (flGLBuffer_t *)calloc(1, sizeof(flGLBuffer_t));
+    if (buffer == NULL) return NULL;
+
+    glGenVertexArrays(1, &buffer->vao);
+    glGenBuffers(1, &buffer->vbo);
+    fl_gl_bind_vertex_array(buffer->vao);
+    fl_gl_bind_array_buffer(buffer->vbo);
+    fl_renderer_setup_attributes(0);
+    if (!__fl_instanced) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, __fl_ibo);
+    return buffer;
+}
+
+/*
+ * Uploading all the glyphs respecifies the buffer, since their count
+ * may have changed. Anything less only updates that range
+ */
+static void fl_gl_upload_buffer(void *user, void *buffer,
+        const unsigned char *data, int glyphs, int first, int count)
+{
+    (void)user;
+    fl_gl_bind_array_buffer(((flGLBuffer_t *)buffer)->vbo);
+
+    if (first == 0 && count == glyphs) {
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)__fl_glyph_stride * glyphs,
+            data, GL_STATIC_DRAW);
+    }
+    else {
+        glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)__fl_glyph_stride * first,
+            (GLsizeiptr)__fl_glyph_stride * count,
+            data + (size_t)__fl_glyph_stride * first);
+    }
+}
+
+static void fl_gl_draw_buffer(void *user, void *buffer, int glyphs,
+        const flRenderBatch_t *batches, int numBatches,
+        const GLuint *batchTextures)
+{
+    (void)user;
+    fl_gl_timer_start();
+    fl_gl_use_program();
+    fl_gl_bind_vertex_array(((flGLBuffer_t *)buffer)->vao);
+    fl_gl_bind_array_buffer(((flGLBuffer_t *)buffer)->vbo);
+
+    if (!__fl_instanced && glyphs > __fl_indices_capacity)
+        fl_renderer_build_indices(fl_gl_grow(__fl_indices_capacity, glyphs));
+
+    fl_renderer_draw_batches(batches, numBatches, batchTextures, 0, glyphs);
+}
+
+static void fl_gl_delete_buffer(void *user, void *buffer)
+{
+    flGLBuffer_t *glBuffer = (flGLBuffer_t *)buffer;
+    (void)user;
+
+    /* Deleting the bound vertex array or buffer unbinds it */
+    if (__fl_bound_vao == glBuffer->vao) __fl_bound_vao = 0;
+    if (__fl_bound_buffer == glBuffer->vbo) __fl_bound_buffer = 0;
+    glDeleteVertexArrays(1, &glBuffer->vao);
+    glDeleteBuffers(1, &glBuffer->vbo);
+    free(glBuffer);
+}
+
+/*
+ * Stop timing the frame and pick up the oldest result if it is ready
+ */
+static void fl_gl_end_frame(void *user, flRendererStats_t *stats)
+{
+    (void)user;
+    if (__fl_timer) {
+        if (__fl_timer_running) {
+            glEndQuery(GL_TIME_ELAPSED);
+            __fl_timer_pending[__fl_timer_frame] = true;
+            __fl_timer_running = false;
+            __fl_timer_frame =
+                (__fl_timer_frame + 1) % FL_RENDERER_GPU_TIMER_FRAMES;
+        }
+
+        /*
+         * The next frame reuses the oldest query, its result is lost
+         * if it is still not there
+         */
+        GLuint query = __fl_timer_queries[__fl_timer_frame];
+        if (__fl_timer_pending[__fl_timer_frame]) {
+            GLint available = 0;
+            glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) {
+                GLuint64 elapsed = 0;
+                glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+                __fl_timer_result = (double)elapsed * 1e-9;
+            }
+            __fl_timer_pending[__fl_timer_frame] = false;
+        }
+        stats->gpuTime = __fl_timer_result;
+    }
+
+    stats->drawCalls += __fl_gl_drawCalls;
+    stats->textureBinds += __fl_gl_textureBinds;
+    __fl_gl_drawCalls = 0;
+    __fl_gl_textureBinds = 0;
+
+}
+
+/*
+ * Delete the vertex array, the buffers and the shader program
+ */
+static void fl_gl_destroy(void *user)
+{
+    (void)user;
+    if (__fl_timer) {
+        if (__fl_timer_running) glEndQuery(GL_TIME_ELAPSED);
+        glDeleteQueries(FL_RENDERER_GPU_TIMER_FRAMES, __fl_timer_queries);
+        memset(__fl_timer_queries, 0, sizeof(__fl_timer_queries));
+        __fl_timer_running = false;
+        __fl_timer = false;
+    }
+    int i;
+    for (i = 0; i < __fl_stream_frames; i++) {
+        if (__fl_stream_fences[i] != 0) glDeleteSync(__fl_stream_fences[i]);
+        __fl_stream_fences[i] = 0;
+    }
+    __fl_stream_frames = 0;
+    __fl_stream_data = NULL;
+
+    glDeleteProgram(__fl_shader);
+    glDeleteVertexArrays(1, &__fl_vao);
+    glDeleteBuffers(1, &__fl_vbo);
+    glDeleteBuffers(1, &__fl_ibo);
+    glDeleteBuffers(1, &__fl_indirect_buffer);
+    glDeleteBuffers(1, &__fl_handle_buffer);
+    __fl_vao = 0;
+    __fl_vbo = 0;
+    __fl_ibo = 0;
+    __fl_indirect_buffer = 0;
+    __fl_handle_buffer = 0;
+    __fl_pr_matrix_location = -1;
+    __fl_projection_set = false;
+    fl_gl_invalidate();
+
+    fl_texture_handles_release();
+    free(__fl_drawCommands);
+    free(__fl_textureHandles);
+    __fl_drawCommands = NULL;
+    __fl_textureHandles = NULL;
+    __fl_drawCommands_capacity = 0;
+    __fl_textureHandles_capacity = 0;
+    __fl_indices_capacity = 0;
+}
+
+#endif /* FL_HEADLESS */
+
+/*
+ * The null backend keeps no GPU state at all.
+ * What it is handed is added up in the recording passed as user.
+ * The last frame's glyph data is copied to the recording as an upload
+ * would, or written there directly in streaming mode.
+ */
+static bool fl_null_reserve(flRendererRecording_t *recording, size_t size)
+{
+    if (size <= recording->dataCapacity) return 0;
+
+    void *data = realloc(recording->data, size);
+    if (data == NULL) return -1;
+    recording->data = (unsigned char *)data;
+    recording->dataCapacity = size;
+    return 0;
+}
+
+static void fl_null_configure(void *user, flRendererConfig_t *config)
+{
+    (void)user;
+    if (config->streamingFrames > FL_RENDERER_MAX_STREAMING_FRAMES)
+        config->streamingFrames = FL_RENDERER_MAX_STREAMING_FRAMES;
+}
+
+static bool fl_null_init(void *user, const flRendererConfig_t *config)
+{
+    return fl_null_reserve((flRendererRecording_t *)user,
+        (size_t)__fl_glyph_space * config->maxGlyphs);
+}
+
+static void fl_null_set_projection(void *user, const flMat4_t *pr_matrix)
+{
+    (void)user;
+    (void)pr_matrix;
+}
+
+static unsigned char *fl_null_map(void *user, int glyphs)
+{
+    flRendererRecording_t *recording = (flRendererRecording_t *)user;
+    if (fl_null_reserve(recording, (size_t)__fl_glyph_space * glyphs) != 0)
+        return NULL;
+    return recording->data;
+}
+
+static void fl_null_draw(void *user, const unsigned char *data, int glyphs,
+        const flRenderBatch_t *batches, int numBatches,
+        const GLuint *batchTextures)
+{
+    (void)batchTextures;
+    flRendererRecording_t *recording = (flRendererRecording_t *)user;
+    size_t size = fl_glyph_data_size(glyphs, batches, numBatches);
+
+    if (data != recording->data) {
+        if (fl_null_reserve(recording, size) != 0) return;
+        memcpy(recording->data, data, size);
+    }
+
+    recording->dataSize = size;
+    recording->uploadedBytes += size;
+    recording->frames++;
+    recording->glyphs += glyphs;
+    recording->batches += numBatches;
+}
+
+/*
+ * Retained layers keep nothing either, the recording stands in
+ * for their buffers
+ */
+static void *fl_null_create_buffer(void *user)
+{
+    return user;
+}
+
+static void fl_null_upload_buffer(void *user, void *buffer,
+        const unsigned char *data, int glyphs, int first, int count)
+{
+    (void)buffer;
+    (void)data;
+    (void)glyphs;
+    (void)first;
+    ((flRendererRecording_t *)user)->uploadedBytes +=
+        (size_t)__fl_glyph_stride * count;
+}
+
+static void fl_null_draw_buffer(void *user, void *buffer, int glyphs,
+        const flRenderBatch_t *batches, int numBatches,
+        const GLuint *batchTextures)
+{
+    (void)buffer;
+    (void)batches;
+    (void)batchTextures;
+    flRendererRecording_t *recording = (flRendererRecording_t *)user;
+    recording->glyphs += glyphs;
+    recording->batches += numBatches;
+}
+
+static void fl_null_delete_buffer(void *user, void *buffer)
+{
+    (void)user;
+    (void)buffer;
+}
+
+static void fl_null_end_frame(void *user, flRendererStats_t *stats)
+{
+    (void)user;
+    (void)stats;
+}
+
+static void fl_null_destroy(void *user)
+{
+    flRendererRecording_t *recording = (flRendererRecording_t *)user;
+    free(recording->data);
+    recording->data = NULL;
+    recording->dataSize = 0;
+    recording->dataCapacity = 0;
+}
+
+/**
+ * Create an identity matrix.
+ * @param out: the matrix to store the result.
+ */
+FLAPI void flMat4Identity(flMat4_t *out)
+{
+    memset(out->data, 0, sizeof(flMat4_t));
+
+    out->data[0 * 4 + 0]  = 1.0f;
+    out->data[1 * 4 + 1]  = 1.0f;
+    out->data[2 * 4 + 2]  = 1.0f;
+    out->data[3 * 4 + 3]  = 1.0f;
+}
+
+/**
+ * Create an orthographic projection matrix.
+ * @param left
+ * @param right
+ * @param bottom
+ * @param top
+ * @param near
+ * @param far
+ * @param out: the matrix to store the result.
+ */
+FLAPI void flMat4Ortho(float left, float right, float bottom, float top,
+        float near, float far, flMat4_t *out)
+{
+    flMat4Identity(out);
 
     out->data[0 * 4 + 0] = 2.0f / (right - left);
     out->data[1 * 4 + 1] = 2.0f / (top - bottom);
@@ -309,6 +3152,240 @@ FLAPI void flMat4Ortho(float left, float right, float bottom, float top,
     out->data[3 * 4 + 2] = (near + far) / (near - far);
 }
 
+/**
+ * Multiply two matrices, out = a * b.
+ * @param a: the left matrix
+ * @param b: the right matrix
+ * @param out: the matrix to store the result. It can be a or b.
+ */
+FLAPI void flMat4Multiply(const flMat4_t *a, const flMat4_t *b, flMat4_t *out)
+{
+    /*
+     * Every column of the result is the columns of a
+     * weighted by the same column of b
+     */
+    flMat4_t result;
+    const float *w = b->data;
+    int col;
+#if defined(FL_SIMD_SSE2)
+    __m128 a0 = _mm_loadu_ps(a->data + 0);
+    __m128 a1 = _mm_loadu_ps(a->data + 4);
+    __m128 a2 = _mm_loadu_ps(a->data + 8);
+    __m128 a3 = _mm_loadu_ps(a->data + 12);
+    for (col = 0; col < 4; col++, w += 4) {
+        __m128 r = _mm_mul_ps(a0, _mm_set1_ps(w[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(w[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(w[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(w[3])));
+        _mm_storeu_ps(result.data + col * 4, r);
+    }
+#elif defined(FL_SIMD_NEON)
+    float32x4_t a0 = vld1q_f32(a->data + 0);
+    float32x4_t a1 = vld1q_f32(a->data + 4);
+    float32x4_t a2 = vld1q_f32(a->data + 8);
+    float32x4_t a3 = vld1q_f32(a->data + 12);
+    for (col = 0; col < 4; col++, w += 4) {
+        float32x4_t r = vmulq_n_f32(a0, w[0]);
+        r = vmlaq_n_f32(r, a1, w[1]);
+        r = vmlaq_n_f32(r, a2, w[2]);
+        r = vmlaq_n_f32(r, a3, w[3]);
+        vst1q_f32(result.data + col * 4, r);
+    }
+#else
+    for (col = 0; col < 4; col++, w += 4) {
+        int row;
+        for (row = 0; row < 4; row++)
+            result.data[col * 4 + row] = a->data[0 * 4 + row] * w[0] +
+                a->data[1 * 4 + row] * w[1] + a->data[2 * 4 + row] * w[2] +
+                a->data[3 * 4 + row] * w[3];
+    }
+#endif
+    *out = result;
+}
+
+/**
+ * Invert a matrix.
+ * @param m: the matrix to invert
+ * @param out: the matrix to store the result. It can be m.
+ * @return 0 on success, -1 when m can not be inverted.
+ */
+FLAPI bool flMat4Inverse(const flMat4_t *m, flMat4_t *out)
+{
+    /*
+     * The adjugate over the determinant. Each pair of columns gives
+     * the 2x2 determinants its cofactors are built from.
+     * It runs once per camera, the batch transforms are the ones worth SIMD
+     */
+    const float *d = m->data;
+    float s0 = d[0] * d[5] - d[4] * d[1];
+    float s1 = d[0] * d[6] - d[4] * d[2];
+    float s2 = d[0] * d[7] - d[4] * d[3];
+    float s3 = d[1] * d[6] - d[5] * d[2];
+    float s4 = d[1] * d[7] - d[5] * d[3];
+    float s5 = d[2] * d[7] - d[6] * d[3];
+
+    float c5 = d[10] * d[15] - d[14] * d[11];
+    float c4 = d[9] * d[15] - d[13] * d[11];
+    float c3 = d[9] * d[14] - d[13] * d[10];
+    float c2 = d[8] * d[15] - d[12] * d[11];
+    float c1 = d[8] * d[14] - d[12] * d[10];
+    float c0 = d[8] * d[13] - d[12] * d[9];
+
+    float det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+    if (det == 0.0f || det != det) return -1;
+
+    float inv = 1.0f / det;
+    flMat4_t result;
+    float *r = result.data;
+    r[0] = (d[5] * c5 - d[6] * c4 + d[7] * c3) * inv;
+    r[1] = (-d[1] * c5 + d[2] * c4 - d[3] * c3) * inv;
+    r[2] = (d[13] * s5 - d[14] * s4 + d[15] * s3) * inv;
+    r[3] = (-d[9] * s5 + d[10] * s4 - d[11] * s3) * inv;
+
+    r[4] = (-d[4] * c5 + d[6] * c2 - d[7] * c1) * inv;
+    r[5] = (d[0] * c5 - d[2] * c2 + d[3] * c1) * inv;
+    r[6] = (-d[12] * s5 + d[14] * s2 - d[15] * s1) * inv;
+    r[7] = (d[8] * s5 - d[10] * s2 + d[11] * s1) * inv;
+
+    r[8] = (d[4] * c4 - d[5] * c2 + d[7] * c0) * inv;
+    r[9] = (-d[0] * c4 + d[1] * c2 - d[3] * c0) * inv;
+    r[10] = (d[12] * s4 - d[13] * s2 + d[15] * s0) * inv;
+    r[11] = (-d[8] * s4 + d[9] * s2 - d[11] * s0) * inv;
+
+    r[12] = (-d[4] * c3 + d[5] * c1 - d[6] * c0) * inv;
+    r[13] = (d[0] * c3 - d[1] * c1 + d[2] * c0) * inv;
+    r[14] = (-d[12] * s3 + d[13] * s1 - d[14] * s0) * inv;
+    r[15] = (d[8] * s3 - d[9] * s1 + d[10] * s0) * inv;
+
+    *out = result;
+    return 0;
+}
+
+/**
+ * Transform points on the z = 0 plane by a matrix, keeping x and y.
+ * @param m: the matrix to transform by
+ * @param in: the points to transform
+ * @param out: where to store them. It can be in.
+ * @param count: how many points there are
+ */
+FLAPI void flMat4TransformVec2(const flMat4_t *m, const flVec2_t *in,
+        flVec2_t *out, int count)
+{
+    const float *d = m->data;
+    int i = 0;
+#if defined(FL_SIMD_SSE2)
+    /*
+     * Two points at a time, as x0 y0 x1 y1
+     */
+    __m128 cx = _mm_setr_ps(d[0], d[1], d[0], d[1]);
+    __m128 cy = _mm_setr_ps(d[4], d[5], d[4], d[5]);
+    __m128 ct = _mm_setr_ps(d[12], d[13], d[12], d[13]);
+    for (; i + 2 <= count; i += 2) {
+        __m128 p = _mm_loadu_ps(&in[i].x);
+        __m128 x = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128 r = _mm_add_ps(ct, _mm_mul_ps(cx, x));
+        _mm_storeu_ps(&out[i].x, _mm_add_ps(r, _mm_mul_ps(cy, y)));
+    }
+#elif defined(FL_SIMD_NEON)
+    float32x2_t cx = vld1_f32(d + 0);
+    float32x2_t cy = vld1_f32(d + 4);
+    float32x2_t ct = vld1_f32(d + 12);
+    for (; i < count; i++) {
+        float32x2_t p = vld1_f32(&in[i].x);
+        float32x2_t r = vmla_lane_f32(ct, cx, p, 0);
+        vst1_f32(&out[i].x, vmla_lane_f32(r, cy, p, 1));
+    }
+#endif
+    for (; i < count; i++) {
+        float x = in[i].x;
+        float y = in[i].y;
+        out[i].x = d[0] * x + d[4] * y + d[12];
+        out[i].y = d[1] * x + d[5] * y + d[13];
+    }
+}
+
+/**
+ * Transform vectors by a matrix.
+ * @param m: the matrix to transform by
+ * @param in: the vectors to transform
+ * @param out: where to store them. It can be in.
+ * @param count: how many vectors there are
+ */
+FLAPI void flMat4TransformVec4(const flMat4_t *m, const flVec4_t *in,
+        flVec4_t *out, int count)
+{
+    const float *d = m->data;
+    int i;
+#if defined(FL_SIMD_SSE2)
+    __m128 c0 = _mm_loadu_ps(d + 0);
+    __m128 c1 = _mm_loadu_ps(d + 4);
+    __m128 c2 = _mm_loadu_ps(d + 8);
+    __m128 c3 = _mm_loadu_ps(d + 12);
+    for (i = 0; i < count; i++) {
+        __m128 v = _mm_loadu_ps(&in[i].x);
+        __m128 r = _mm_mul_ps(c0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)));
+        r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))));
+        r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+        r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))));
+        _mm_storeu_ps(&out[i].x, r);
+    }
+#elif defined(FL_SIMD_NEON)
+    float32x4_t c0 = vld1q_f32(d + 0);
+    float32x4_t c1 = vld1q_f32(d + 4);
+    float32x4_t c2 = vld1q_f32(d + 8);
+    float32x4_t c3 = vld1q_f32(d + 12);
+    for (i = 0; i < count; i++) {
+        float32x4_t v = vld1q_f32(&in[i].x);
+        float32x4_t r = vmulq_lane_f32(c0, vget_low_f32(v), 0);
+        r = vmlaq_lane_f32(r, c1, vget_low_f32(v), 1);
+        r = vmlaq_lane_f32(r, c2, vget_high_f32(v), 0);
+        r = vmlaq_lane_f32(r, c3, vget_high_f32(v), 1);
+        vst1q_f32(&out[i].x, r);
+    }
+#else
+    for (i = 0; i < count; i++) {
+        flVec4_t v = in[i];
+        out[i].x = d[0] * v.x + d[4] * v.y + d[8] * v.z + d[12] * v.w;
+        out[i].y = d[1] * v.x + d[5] * v.y + d[9] * v.z + d[13] * v.w;
+        out[i].z = d[2] * v.x + d[6] * v.y + d[10] * v.z + d[14] * v.w;
+        out[i].w = d[3] * v.x + d[7] * v.y + d[11] * v.z + d[15] * v.w;
+    }
+#endif
+}
+
+/**
+ * Create a 2D transform the way flRendererDrawTransformed places a rectangle.
+ * @param position: where origin ends up
+ * @param origin: the point everything is scaled and rotated around
+ * @param rotation: the rotation in radians, clockwise with y going down
+ * @param scale: the scale along x and y
+ * @param out: the matrix to store the result.
+ */
+FLAPI void flMat4Transform2D(flVec2_t position, flVec2_t origin,
+        float rotation, flVec2_t scale, flMat4_t *out)
+{
+    float c = cosf(rotation);
+    float s = sinf(rotation);
+
+    flMat4Identity(out);
+
+    out->data[0 * 4 + 0] = c * scale.x;
+    out->data[0 * 4 + 1] = s * scale.x;
+    out->data[1 * 4 + 0] = -s * scale.y;
+    out->data[1 * 4 + 1] = c * scale.y;
+
+    /*
+     * origin is moved to position after being scaled and rotated itself
+     */
+    out->data[3 * 4 + 0] = position.x -
+        (out->data[0] * origin.x + out->data[4] * origin.y);
+    out->data[3 * 4 + 1] = position.y -
+        (out->data[1] * origin.x + out->data[5] * origin.y);
+}
+
+#ifndef FL_HEADLESS
+
 /**
  * Attach a shader to the program.
  * @param program: the program id generated with glCreateProgram.
@@ -370,74 +3447,285 @@ FLAPI bool flShaderLink(GLuint program)
     return 0;
 }
 
+#endif /* FL_HEADLESS */
+
+#ifndef FL_HEADLESS
+
+/**
+ * Fill out with the OpenGL backend, the default one.
+ * @param out: the backend to fill
+ */
+FLAPI void flRendererGLBackend(flRendererBackend_t *out)
+{
+    out->user = NULL;
+    out->configure = fl_gl_configure;
+    out->init = fl_gl_init;
+    out->setProjection = fl_gl_set_projection;
+    out->map = fl_gl_map;
+    out->draw = fl_gl_draw;
+    out->createBuffer = fl_gl_create_buffer;
+    out->uploadBuffer = fl_gl_upload_buffer;
+    out->drawBuffer = fl_gl_draw_buffer;
+    out->deleteBuffer = fl_gl_delete_buffer;
+    out->endFrame = fl_gl_end_frame;
+    out->destroy = fl_gl_destroy;
+}
+
+/**
+ * Forget the OpenGL state the renderer tracks.
+ * Call it after GL calls of your own, the renderer keeps what it knows
+ * across frames.
+ */
+FLAPI void flRendererInvalidateGLState()
+{
+    fl_gl_invalidate();
+}
+
+/**
+ * Release the bindless handle the renderer keeps for a texture.
+ * Call it before deleting a texture drawn in indirect mode.
+ * @param texture: the texture about to be deleted
+ */
+FLAPI void flRendererReleaseTexture(GLuint texture)
+{
+    if (texture >= __fl_residentHandles_capacity) return;
+    if (__fl_residentHandles[texture] == 0) return;
+
+    glMakeTextureHandleNonResidentARB(__fl_residentHandles[texture]);
+    __fl_residentHandles[texture] = 0;
+}
+
+#endif /* FL_HEADLESS */
+
+/**
+ * Fill out with the null backend.
+ * @param recording: where the backend adds up what it is handed
+ * @param out: the backend to fill
+ */
+FLAPI void flRendererNullBackend(flRendererRecording_t *recording,
+        flRendererBackend_t *out)
+{
+    out->user = recording;
+    out->configure = fl_null_configure;
+    out->init = fl_null_init;
+    out->setProjection = fl_null_set_projection;
+    out->map = fl_null_map;
+    out->draw = fl_null_draw;
+    out->createBuffer = fl_null_create_buffer;
+    out->uploadBuffer = fl_null_upload_buffer;
+    out->drawBuffer = fl_null_draw_buffer;
+    out->deleteBuffer = fl_null_delete_buffer;
+    out->endFrame = fl_null_end_frame;
+    out->destroy = fl_null_destroy;
+}
+
+/**
+ * Pick the backend the renderer draws with.
+ * @param backend: the backend to use, copied. NULL picks the default one.
+ */
+FLAPI void flRendererSetBackend(const flRendererBackend_t *backend)
+{
+    if (backend != NULL) {
+        __fl_backend = *backend;
+    }
+    else {
+#ifndef FL_HEADLESS
+        flRendererGLBackend(&__fl_backend);
+#else
+        static flRendererRecording_t recording;
+        flRendererNullBackend(&recording, &__fl_backend);
+#endif
+    }
+    __fl_backend_set = true;
+}
+
+/**
+ * Take the scratch storage of every flush from the caller's allocator.
+ * @param scratch: the allocator to use, copied. NULL goes back to the
+ *      renderer's own storage.
+ */
+FLAPI void flRendererSetScratch(const flRendererScratch_t *scratch)
+{
+    if (scratch != NULL && scratch->alloc != NULL) {
+        __fl_scratch = *scratch;
+        fl_flush_release();
+    }
+    else {
+        /*
+         * The renderer's own storage grows back on the next flush
+         */
+        __fl_scratch.user = NULL;
+        __fl_scratch.alloc = NULL;
+    }
+}
+
+/**
+ * Initializes the renderer.
+ * Creates and sets up the shader, the vertex array and the vertex buffer.
+ * Should be called once and *AFTER* the OpenGL context has been created.
+ * Same as flRendererInitWithConfig with FL_RENDERER_MAX_GLYPHS glyphs,
+ * no growth, no streaming, no instancing
+ * and FL_RENDERER_MAX_TEXTURE_UNITS texture units.
+ */
+FLAPI void flRendererInit()
+{
+    flRendererConfig_t config;
+    config.maxGlyphs = FL_RENDERER_MAX_GLYPHS;
+    config.growable = false;
+    config.streamingFrames = 0;
+    config.instanced = false;
+    config.textureUnits = FL_RENDERER_MAX_TEXTURE_UNITS;
+    config.multiDrawIndirect = false;
+    config.gpuTimer = false;
+    config.compactVertices = false;
+    config.programCache = NULL;
+    config.pipelined = false;
+    flRendererInitWithConfig(&config);
+}
+
 /**
- * Initializes the renderer.
- * Creates and sets up the shader, the vertex array and the vertex buffer.
+ * Initializes the renderer with the given settings.
  * Should be called once and *AFTER* the OpenGL context has been created.
+ * @param config: the renderer settings. See flRendererConfig_t.
  */
-FLAPI void flRendererInit()
+FLAPI void flRendererInitWithConfig(const flRendererConfig_t *config)
 {
-    __fl_shader = glCreateProgram();
-    FLASSERT(__fl_shader != 0);
-
-    bool err = 0;
+    __fl_config = *config;
+    FLASSERT(__fl_config.maxGlyphs > 0);
+    if (__fl_config.maxGlyphs <= 0) __fl_config.maxGlyphs = FL_RENDERER_MAX_GLYPHS;
 
-    err = flShaderAttach(__fl_shader, __fl_vertex_shader, GL_VERTEX_SHADER);
-    FLASSERT(err == 0);
+    /*
+     * A batch never holds more textures than the shader can sample from.
+     * The indirect mode has no such limit, it keeps the same one
+     * so every mode batches the same way
+     */
+    if (__fl_config.textureUnits < 1) __fl_config.textureUnits = 1;
+    if (__fl_config.textureUnits > FL_RENDERER_MAX_TEXTURE_UNITS)
+        __fl_config.textureUnits = FL_RENDERER_MAX_TEXTURE_UNITS;
 
-    err = flShaderAttach(__fl_shader, __fl_fragment_shader, GL_FRAGMENT_SHADER);
-    FLASSERT(err == 0);
+    if (!__fl_backend_set) flRendererSetBackend(NULL);
 
-    err = flShaderLink(__fl_shader);
-    FLASSERT(err == 0);
+    /*
+     * Let the backend turn off the modes it cannot do before allocating
+     * anything, they decide what storage is needed
+     */
+    __fl_backend.configure(__fl_backend.user, &__fl_config);
+    __fl_instanced = __fl_config.instanced;
+    __fl_config.compactVertices = __fl_config.compactVertices && !__fl_instanced;
+    __fl_compact = __fl_config.compactVertices;
+    __fl_glyph_stride = __fl_instanced ? FL_INSTANCE_SIZE :
+        (__fl_compact ? FL_COMPACT_VERTEX_SIZE : FL_VERTEX_SIZE) *
+        FL_GLYPH_VERTICES;
+    __fl_glyph_space = __fl_glyph_stride +
+        (__fl_instanced ? FL_TRANSFORM_SIZE : 0);
+    __fl_indirect = __fl_config.multiDrawIndirect;
+    __fl_texture_units = __fl_config.textureUnits;
 
+    /*
+     * A pipelined frame is never drawn before it is handed over,
+     * all it can do is grow. Both sets of glyphs start out the same
+     */
+    if (__fl_config.pipelined) __fl_config.growable = true;
 
-    int __fl_shader_attrib0 = glGetAttribLocation(__fl_shader, "position");
-    int __fl_shader_attrib1 = glGetAttribLocation(__fl_shader, "uv");
-    int __fl_shader_attrib2 = glGetAttribLocation(__fl_shader, "color");
+    bool err = 0;
 
-    glBindAttribLocation(__fl_shader, __fl_shader_attrib0, "position");
-    glBindAttribLocation(__fl_shader, __fl_shader_attrib1, "uv");
-    glBindAttribLocation(__fl_shader, __fl_shader_attrib2, "color");
+    err = fl_renderer_reserve(__fl_config.maxGlyphs);
+    FLASSERT(err == 0);
 
-    glUseProgram(__fl_shader);
+    if (__fl_config.pipelined) {
+        err = fl_context_reserve(&__fl_frame.context, __fl_config.maxGlyphs);
+        FLASSERT(err == 0);
+    }
+    if (__fl_scratch.alloc == NULL) {
+        err = fl_flush_reserve(__fl_config.maxGlyphs);
+        FLASSERT(err == 0);
+    }
 
-    if (__fl_vao == 0) glGenVertexArrays(1, &__fl_vao);
-    FLASSERT(__fl_vao != 0);
-    glBindVertexArray(__fl_vao);
+    err = __fl_backend.init(__fl_backend.user, &__fl_config);
+    FLASSERT(err == 0);
+    (void)err;
 
-    if (__fl_vbo == 0) glGenBuffers(1, &__fl_vbo);
-    FLASSERT(__fl_vbo != 0);
-    glBindBuffer(GL_ARRAY_BUFFER, __fl_vbo);
+    memset(&__fl_stats, 0, sizeof(__fl_stats));
+    memset(&__fl_frame_stats, 0, sizeof(__fl_frame_stats));
+    __fl_stats.gpuTime = -1.0;
+    __fl_frame_stats.gpuTime = -1.0;
+#ifndef NDEBUG
+    __fl_glyphs_highWater = 0;
+    __fl_renderBatches_highWater = 0;
+#endif
+}
 
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
+/**
+ * Set the projection matrix for the renderer to use.
+ * The upload to OpenGL waits until the renderer next uses its shader to
+ * draw, in the pipelined mode it goes along with the next frame handed
+ * over instead.
+ * Call this after renderer has been initialized.
+ * @param pr_matrix: the projection matrix to use.
+ */
+FLAPI void flRendererSetProjectionMatrix(const flMat4_t *pr_matrix)
+{
+    if (__fl_config.pipelined) {
+        __fl_frame_projection = *pr_matrix;
+        __fl_frame_projection_set = true;
+    } else {
+        __fl_backend.setProjection(__fl_backend.user, pr_matrix);
+    }
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, false, FL_VERTEX_SIZE,
-        (const void *)0);
+    /*
+     * Keep the rows that give the clip space x and y of a point on the
+     * z = 0 plane. With a perspective divide w is not 1 and the bounds
+     * would be wrong, zero rows keep every glyph instead
+     */
+    const float *m = pr_matrix->data;
+    bool affine = m[3] == 0.0f && m[7] == 0.0f && m[15] == 1.0f;
+    int row;
+    for (row = 0; row < 2; row++) {
+        __fl_cull_row[row][0] = affine ? m[0 * 4 + row] : 0.0f;
+        __fl_cull_row[row][1] = affine ? m[1 * 4 + row] : 0.0f;
+        __fl_cull_row[row][2] = affine ? m[3 * 4 + row] : 0.0f;
+    }
+}
 
-    glVertexAttribPointer(1, 2, GL_FLOAT, false, FL_VERTEX_SIZE,
-        (const void *)(sizeof(flVec2_t)));
+/**
+ * Limit the glyphs kept to the ones overlapping viewRect, on top of
+ * the projection.
+ * @param viewRect: the rectangle in the coordinates of the destination
+ *      rectangles, as x, y, width, height. NULL removes the limit.
+ */
+FLAPI void flRendererSetViewRect(const flVec4_t *viewRect)
+{
+    if (viewRect == NULL) {
+        __fl_cull_view[0] = -FLT_MAX;
+        __fl_cull_view[1] = -FLT_MAX;
+        __fl_cull_view[2] = FLT_MAX;
+        __fl_cull_view[3] = FLT_MAX;
+        return;
+    }
 
-    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, true, FL_VERTEX_SIZE,
-        (const void *)(sizeof(flVec2_t) * 2));
+    __fl_cull_view[0] = viewRect->x;
+    __fl_cull_view[1] = viewRect->y;
+    __fl_cull_view[2] = viewRect->x + viewRect->z;
+    __fl_cull_view[3] = viewRect->y + viewRect->w;
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+/**
+ * How many glyphs were culled since flRendererBegin.
+ */
+FLAPI int flRendererGetCulledCount()
+{
+    return __fl_context.culled;
 }
 
 /**
- * Set the projection matrix for the renderer to use.
- * It pushes it directly to OpenGL.
- * Call this after renderer has been initialized.
- * @param pr_matrix: the projection matrix to use.
+ * What the renderer did in the last frame flRendererEnd finished.
+ * In the pipelined mode the last one flRendererSubmit finished,
+ * call it from the same thread.
+ * @param stats: where to store them
  */
-FLAPI void flRendererSetProjectionMatrix(const flMat4_t *pr_matrix)
+FLAPI void flRendererGetStats(flRendererStats_t *stats)
 {
-    int loc = glGetUniformLocation(__fl_shader, "pr_matrix");
-    FLASSERT(loc != -1);
-    glUniformMatrix4fv(loc, 1, false, pr_matrix->data);
+    *stats = __fl_frame_stats;
 }
 
 /**
@@ -445,10 +3733,22 @@ FLAPI void flRendererSetProjectionMatrix(const flMat4_t *pr_matrix)
  */
 FLAPI void flRendererBegin()
 {
-    __fl_glyphs_size = 0;
-    memset(__fl_glyphs, 0, FL_GLYPH_SIZE * FL_RENDERER_MAX_GLYPHS);
-    memset(__fl_renderBatches, 0, FL_RENDER_BATCH_SIZE *FL_RENDERER_MAX_GLYPHS);
-    memset(__fl_vertices, 0, FL_VERTEX_SIZE * FL_RENDERER_MAX_VERTICES);
+    flRendererBeginWithSortMode(FL_SORT_TEXTURE);
+}
+
+/**
+ * Begin the drawing sequence with the given sort mode.
+ * @param sortMode: how the glyphs are ordered. See flSortMode_t.
+ */
+FLAPI void flRendererBeginWithSortMode(flSortMode_t sortMode)
+{
+    /*
+     * Everything past the counter is overwritten before it is read
+     * so there is nothing to clear
+     */
+    __fl_context.size = 0;
+    __fl_context.culled = 0;
+    __fl_sort_mode = sortMode;
 }
 
 /**
@@ -470,170 +3770,620 @@ FLAPI void flRendererBegin()
  */
 FLAPI void flRendererDraw(GLuint texture, flVec4_t destRectangle,
         flVec4_t srcRectangle, GLuint color)
+{
+    flRendererDrawLayered(texture, destRectangle, srcRectangle, color,
+        0, 0.0f);
+}
+
+/**
+ * Draw a textured rectangle on a layer and at a depth.
+ * Takes the same arguments as flRendererDraw.
+ * @param layer: glyphs on lower layers are drawn first
+ * @param depth: the distance from the viewer
+ */
+FLAPI void flRendererDrawLayered(GLuint texture, flVec4_t destRectangle,
+        flVec4_t srcRectangle, GLuint color, int layer, float depth)
+{
+    /*
+     * if we reached the end of the array grow it when allowed to.
+     * Otherwise flush and start over
+     */
+    if (fl_renderer_make_room() != 0) return;
+
+    fl_context_push(&__fl_context, fl_sort_key(texture, layer, depth),
+        texture, &destRectangle, &srcRectangle, color);
+}
+
+/**
+ * Draw count textured rectangles from arrays, all at once.
+ * Same as calling flRendererDraw for each of them, without the per call
+ * overhead. Room for all of them is made once when the renderer is growable.
+ * Every array is read with its own stride, the bytes from one element to
+ * the next. Pass the size of the element for a packed array, the size of
+ * the struct for a field of an array of structs or 0 to use the first
+ * element for all of them.
+ * @param count: how many rectangles to draw
+ * @param textures, textureStride: the texture of each rectangle
+ * @param destRectangles, destStride: the destination rectangles
+ * @param srcRectangles, srcStride: the source rectangles
+ * @param colors, colorStride: the colors, 0xAABBGGRR format
+ */
+FLAPI void flRendererDrawMany(int count,
+        const GLuint *textures, size_t textureStride,
+        const flVec4_t *destRectangles, size_t destStride,
+        const flVec4_t *srcRectangles, size_t srcStride,
+        const GLuint *colors, size_t colorStride)
+{
+    const unsigned char *texture = (const unsigned char *)textures;
+    const unsigned char *dest = (const unsigned char *)destRectangles;
+    const unsigned char *src = (const unsigned char *)srcRectangles;
+    const unsigned char *color = (const unsigned char *)colors;
+
+    /*
+     * Grow once for all of them when allowed to.
+     * If that fails they are drawn in chunks, growing or flushing in between
+     */
+    int needed = __fl_context.size + count;
+    if (__fl_config.growable && needed > __fl_context.capacity) {
+        int capacity = __fl_context.capacity;
+        while (capacity < needed) capacity *= 2;
+        fl_renderer_reserve(capacity);
+    }
+
+    while (count > 0) {
+        if (fl_renderer_make_room() != 0) return;
+
+        /*
+         * Culled glyphs take no room, so at least this many fit
+         */
+        int chunk = __fl_context.capacity - __fl_context.size;
+        if (chunk > count) chunk = count;
+        count -= chunk;
+
+        int i;
+        for (i = 0; i < chunk; i++) {
+            GLuint glyphTexture = *(const GLuint *)texture;
+            fl_context_push(&__fl_context, fl_sort_key(glyphTexture, 0, 0.0f),
+                glyphTexture, (const flVec4_t *)dest, (const flVec4_t *)src,
+                *(const GLuint *)color);
+
+            texture += textureStride;
+            dest += destStride;
+            src += srcStride;
+            color += colorStride;
+        }
+    }
+}
+
+/**
+ * Draw a rotated and scaled textured rectangle.
+ * @param texture: the texture id
+ * @param position: where origin ends up
+ * @param size: the size of the rectangle before scaling
+ * @param origin: the point the rectangle is placed, rotated and scaled by
+ * @param rotation: the rotation in radians, clockwise with y going down
+ * @param scale: multiplies size
+ * @param srcRectangle: the source rectangle
+ * @param color: the integer color to use for blending 0xAABBGGRR format
+ */
+FLAPI void flRendererDrawTransformed(GLuint texture, flVec2_t position,
+        flVec2_t size, flVec2_t origin, float rotation, flVec2_t scale,
+        flVec4_t srcRectangle, GLuint color)
 {
     /*
-     * if we reached the end of the array flush and start over
+     * Scaling is done here, it is just the rectangle and origin it gives
      */
-    if (__fl_glyphs_size >= FL_RENDERER_MAX_GLYPHS) {
-        flRendererEnd();
-        flRendererBegin();
+    flVec2_t scaledOrigin;
+    scaledOrigin.x = origin.x * scale.x;
+    scaledOrigin.y = origin.y * scale.y;
+
+    flVec4_t destRectangle;
+    destRectangle.x = position.x - scaledOrigin.x;
+    destRectangle.y = position.y - scaledOrigin.y;
+    destRectangle.z = size.x * scale.x;
+    destRectangle.w = size.y * scale.y;
+
+    if (fl_renderer_make_room() != 0) return;
+
+    fl_context_push_rotated(&__fl_context, fl_sort_key(texture, 0, 0.0f),
+        texture, &destRectangle, &srcRectangle, color, &scaledOrigin,
+        rotation);
+}
+
+/**
+ * Create a recording context.
+ * Call it from the thread that calls flRendererEnd.
+ * @param maxGlyphs: the initial glyph capacity. It grows when needed.
+ * @return the new context or NULL if out of memory.
+ */
+FLAPI flRenderContext_t *flRenderContextCreate(int maxGlyphs)
+{
+    flRenderContext_t *context =
+        (flRenderContext_t *)calloc(1, sizeof(flRenderContext_t));
+    if (context == NULL) return NULL;
+
+    if (fl_context_reserve(context, maxGlyphs > 0 ? maxGlyphs : 1) != 0) {
+        free(context->glyphs);
+        free(context->sortKeys);
+        free(context);
+        return NULL;
+    }
+
+    context->next = __fl_contexts;
+    __fl_contexts = context;
+    return context;
+}
+
+/**
+ * Draw a textured rectangle into a recording context.
+ * Same as flRendererDraw, except that it never flushes.
+ * @param context: the context to record into
+ * @param texture:  the texture id
+ * @param destRectangle: the destination rectangle
+ * @param srcRectangle: the source rectangle
+ * @param color: the integer color to use for blending 0xAABBGGRR format
+ */
+FLAPI void flRenderContextDraw(flRenderContext_t *context, GLuint texture,
+        flVec4_t destRectangle, flVec4_t srcRectangle, GLuint color)
+{
+    flRenderContextDrawLayered(context, texture, destRectangle, srcRectangle,
+        color, 0, 0.0f);
+}
+
+/**
+ * Draw a textured rectangle into a recording context on a layer
+ * and at a depth. See flRendererDrawLayered.
+ */
+FLAPI void flRenderContextDrawLayered(flRenderContext_t *context,
+        GLuint texture, flVec4_t destRectangle, flVec4_t srcRectangle,
+        GLuint color, int layer, float depth)
+{
+    if (context->size >= context->capacity &&
+            fl_context_reserve(context, context->capacity * 2) != 0) {
+        FLASSERT(!"out of memory recording into a render context");
+        return;
+    }
+
+    fl_context_push(context, fl_sort_key(texture, layer, depth), texture,
+        &destRectangle, &srcRectangle, color);
+}
+
+/**
+ * Destroy a recording context. Glyphs it still holds are dropped.
+ * Call it from the thread that calls flRendererEnd.
+ * @param context: the context to destroy
+ */
+FLAPI void flRenderContextDestroy(flRenderContext_t *context)
+{
+    flRenderContext_t **link = &__fl_contexts;
+    while (*link != NULL && *link != context) link = &(*link)->next;
+    if (*link != NULL) *link = context->next;
+
+    free(context->glyphs);
+    free(context->sortKeys);
+    free(context);
+}
+
+/**
+ * Create a retained layer.
+ * @param maxGlyphs: the initial glyph capacity. It grows when needed.
+ * @return the new layer or NULL if out of memory.
+ */
+FLAPI flRetainedLayer_t *flRetainedLayerCreate(int maxGlyphs)
+{
+    flRetainedLayer_t *layer =
+        (flRetainedLayer_t *)calloc(1, sizeof(flRetainedLayer_t));
+    if (layer == NULL) return NULL;
+
+    if (fl_context_reserve(&layer->context, maxGlyphs > 0 ? maxGlyphs : 1)) {
+        flRetainedLayerDestroy(layer);
+        return NULL;
+    }
+
+    layer->rebuild = true;
+    return layer;
+}
+
+/**
+ * Add a textured rectangle to the layer.
+ * Takes the same arguments as flRendererDraw.
+ * @param layer: the layer to add to
+ * @return the index of the glyph in the layer, for flRetainedLayerSet
+ *      or -1 if out of memory.
+ */
+FLAPI int flRetainedLayerDraw(flRetainedLayer_t *layer, GLuint texture,
+        flVec4_t destRectangle, flVec4_t srcRectangle, GLuint color)
+{
+    flRenderContext_t *context = &layer->context;
+    if (context->size >= context->capacity &&
+            fl_context_reserve(context, context->capacity * 2) != 0) {
+        FLASSERT(!"out of memory recording into a retained layer");
+        return -1;
     }
 
-    FLASSERT(__fl_glyphs_size < FL_RENDERER_MAX_GLYPHS);
+    fl_context_write(context, context->size, texture, texture,
+        &destRectangle, &srcRectangle, color);
+    layer->rebuild = true;
+    return context->size++;
+}
+
+/**
+ * Replace a glyph of the layer.
+ * @param layer: the layer the glyph belongs to
+ * @param glyph: the index returned by flRetainedLayerDraw
+ * The rest of the arguments are the same as flRendererDraw.
+ */
+FLAPI void flRetainedLayerSet(flRetainedLayer_t *layer, int glyph,
+        GLuint texture, flVec4_t destRectangle, flVec4_t srcRectangle,
+        GLuint color)
+{
+    flRenderContext_t *context = &layer->context;
+    FLASSERT(glyph >= 0 && glyph < context->size);
+    if (glyph < 0 || glyph >= context->size) return;
+
+    flGlyph_t *target = &context->glyphs[glyph];
+    bool sameTexture = target->texture == texture;
+
+    fl_context_write(context, glyph, texture, texture, &destRectangle,
+        &srcRectangle, color);
 
     /*
-     * Get the pointer of the next element in the array of glyphs
+     * A new texture moves the glyph to another batch.
+     * Otherwise it stays where it was sorted, with the same texture slot,
+     * and only its own part of the buffer changes.
      */
-    flGlyph_t *__fl_tmp_glyph = &__fl_glyphs[__fl_glyphs_size++];
+    if (layer->rebuild) return;
+    if (!sameTexture) {
+        layer->rebuild = true;
+        return;
+    }
+
+    int position = layer->positions[glyph];
+    fl_glyph_write(target, fl_glyph_slot(layer->data, position),
+        layer->data, position);
+
+    if (layer->dirtyFirst > layer->dirtyLast) {
+        layer->dirtyFirst = position;
+        layer->dirtyLast = position;
+    }
+    else {
+        if (position < layer->dirtyFirst) layer->dirtyFirst = position;
+        if (position > layer->dirtyLast) layer->dirtyLast = position;
+    }
+}
+
+/**
+ * Remove all the glyphs of the layer so it can be recorded again.
+ * @param layer: the layer to clear
+ */
+FLAPI void flRetainedLayerClear(flRetainedLayer_t *layer)
+{
+    layer->context.size = 0;
+    layer->rebuild = true;
+}
+
+/*
+ * Sort and batch the layer from scratch.
+ * The side arrays follow the capacity of the recorded glyphs.
+ * Returns 0 on success.
+ */
+static bool fl_layer_rebuild(flRetainedLayer_t *layer)
+{
+    flRenderContext_t *context = &layer->context;
+    int size = context->size;
+
+    if (layer->capacity < context->capacity) {
+        int capacity = context->capacity;
+
+        void *keys = realloc(layer->sortKeys, FL_SORT_KEY_SIZE * capacity * 2);
+        if (keys == NULL) return -1;
+        layer->sortKeys = (flSortKey_t *)keys;
+
+        void *positions = realloc(layer->positions, sizeof(GLuint) * capacity);
+        if (positions == NULL) return -1;
+        layer->positions = (GLuint *)positions;
+
+        void *data = realloc(layer->data, __fl_glyph_stride * capacity);
+        if (data == NULL) return -1;
+        layer->data = (unsigned char *)data;
+
+        void *batches = realloc(layer->batches, FL_RENDER_BATCH_SIZE * capacity);
+        if (batches == NULL) return -1;
+        layer->batches = (flRenderBatch_t *)batches;
+
+        void *textures = realloc(layer->batchTextures, sizeof(GLuint) * capacity);
+        if (textures == NULL) return -1;
+        layer->batchTextures = (GLuint *)textures;
+
+        layer->capacity = capacity;
+    }
 
     /*
-     * Construct the new glyph
+     * Sort a copy of the keys, the recorded ones have to stay
+     * in record order for flRetainedLayerSet
      */
-    __fl_tmp_glyph->texture = texture;
+    memcpy(layer->sortKeys, context->sortKeys, FL_SORT_KEY_SIZE * size);
+    const flSortKey_t *keys = fl_sort_keys(layer->sortKeys,
+        layer->sortKeys + layer->capacity, size);
+
+    int i;
+    for (i = 0; i < size; i++) layer->positions[keys[i].glyph] = i;
+
+    layer->numBatches = fl_renderer_batch(context->glyphs, keys, size,
+        layer->data, layer->batches, layer->batchTextures);
+    return 0;
+}
+
+/**
+ * Draw the layer right away with the renderer's shader and projection.
+ * Rebuilds or re-uploads whatever changed since the last call.
+ * Layers drawn before flRendererEnd end up below the glyphs it draws.
+ * In the pipelined mode call it from the thread calling flRendererSubmit,
+ * the layers drawn before it end up below.
+ * @param layer: the layer to draw
+ */
+FLAPI void flRetainedLayerRender(flRetainedLayer_t *layer)
+{
+    int size = layer->context.size;
+    if (size == 0) return;
+
+    if (layer->buffer == NULL) {
+        layer->buffer = __fl_backend.createBuffer(__fl_backend.user);
+        FLASSERT(layer->buffer != NULL);
+        if (layer->buffer == NULL) return;
+    }
+
+    double start = FL_TIME();
+    int uploaded = 0;
+    if (layer->rebuild) {
+        if (fl_layer_rebuild(layer) != 0) {
+            FLASSERT(!"out of memory rebuilding a retained layer");
+            return;
+        }
+        double rebuilt = FL_TIME();
+        __fl_stats.expandTime += rebuilt - start;
+        start = rebuilt;
+
+        __fl_backend.uploadBuffer(__fl_backend.user, layer->buffer,
+            layer->data, size, 0, size);
+        uploaded = size;
+        layer->rebuild = false;
+    }
+    else if (layer->dirtyFirst <= layer->dirtyLast) {
+        uploaded = layer->dirtyLast - layer->dirtyFirst + 1;
+        __fl_backend.uploadBuffer(__fl_backend.user, layer->buffer,
+            layer->data, size, layer->dirtyFirst, uploaded);
+    }
+    layer->dirtyFirst = 1;
+    layer->dirtyLast = 0;
 
-    __fl_tmp_glyph->topLeft.position.x = destRectangle.x;
-    __fl_tmp_glyph->topLeft.position.y = destRectangle.y;
-    __fl_tmp_glyph->topLeft.uv.x = srcRectangle.x;
-    __fl_tmp_glyph->topLeft.uv.y = srcRectangle.y;
-    __fl_tmp_glyph->topLeft.color = color;
+    __fl_backend.drawBuffer(__fl_backend.user, layer->buffer, size,
+        layer->batches, layer->numBatches, layer->batchTextures);
 
-    __fl_tmp_glyph->bottomLeft.position.x = destRectangle.x;
-    __fl_tmp_glyph->bottomLeft.position.y = destRectangle.y + destRectangle.w;
-    __fl_tmp_glyph->bottomLeft.uv.x = srcRectangle.x;
-    __fl_tmp_glyph->bottomLeft.uv.y = srcRectangle.y + srcRectangle.w;
-    __fl_tmp_glyph->bottomLeft.color = color;
+    __fl_stats.uploadTime += FL_TIME() - start;
+    __fl_stats.uploadedBytes += (size_t)__fl_glyph_stride * uploaded;
+    __fl_stats.glyphs += size;
+    __fl_stats.batches += layer->numBatches;
+}
+
+/**
+ * Destroy the layer and its vertex buffer.
+ * @param layer: the layer to destroy
+ */
+FLAPI void flRetainedLayerDestroy(flRetainedLayer_t *layer)
+{
+    if (layer->buffer != NULL)
+        __fl_backend.deleteBuffer(__fl_backend.user, layer->buffer);
 
-    __fl_tmp_glyph->bottomRight.position.x = destRectangle.x + destRectangle.z;
-    __fl_tmp_glyph->bottomRight.position.y = destRectangle.y + destRectangle.w;
-    __fl_tmp_glyph->bottomRight.uv.x = srcRectangle.x + srcRectangle.z;
-    __fl_tmp_glyph->bottomRight.uv.y = srcRectangle.y + srcRectangle.w;
-    __fl_tmp_glyph->bottomRight.color = color;
+    free(layer->context.glyphs);
+    free(layer->context.sortKeys);
+    free(layer->sortKeys);
+    free(layer->positions);
+    free(layer->data);
+    free(layer->batches);
+    free(layer->batchTextures);
+    free(layer);
+}
 
-    __fl_tmp_glyph->topRight.position.x = destRectangle.x + destRectangle.z;
-    __fl_tmp_glyph->topRight.position.y = destRectangle.y;
-    __fl_tmp_glyph->topRight.uv.x = srcRectangle.x + srcRectangle.z;
-    __fl_tmp_glyph->topRight.uv.y = srcRectangle.y;
-    __fl_tmp_glyph->topRight.color = color;
+/*
+ * The frame is done, hand its statistics over
+ */
+static void fl_renderer_end_frame(int culled)
+{
+    __fl_stats.culled = culled;
+    __fl_backend.endFrame(__fl_backend.user, &__fl_stats);
+#ifndef NDEBUG
+    __fl_stats.glyphsHighWater = __fl_glyphs_highWater;
+    __fl_stats.batchesHighWater = __fl_renderBatches_highWater;
+#endif
+    __fl_frame_stats = __fl_stats;
+    memset(&__fl_stats, 0, sizeof(__fl_stats));
+    __fl_stats.gpuTime = -1.0;
 }
 
 /*
- * Integer comparator function for sorting the glyphs by texture id
+ * Hand the default context over to flRendererSubmit and go on recording
+ * into the glyphs it drew last, once it is done with them.
+ * The culled count stays for flRendererGetCulledCount
  */
-static int fl_glyph_comparator(const void *v1, const void *v2)
+static void fl_renderer_hand_over()
 {
-    const flGlyph_t *p1 = (flGlyph_t *)v1;
-    const flGlyph_t *p2 = (flGlyph_t *)v2;
-    return p1->texture - p2->texture;
+    FL_FRAME_LOCK();
+    while (__fl_frame.pending) FL_FRAME_WAIT();
+
+    flRenderContext_t recorded = __fl_context;
+    __fl_context.glyphs = __fl_frame.context.glyphs;
+    __fl_context.sortKeys = __fl_frame.context.sortKeys;
+    __fl_context.capacity = __fl_frame.context.capacity;
+    __fl_context.size = 0;
+    __fl_frame.context = recorded;
+    __fl_frame.context.next = NULL;
+    __fl_frame.sortMode = __fl_sort_mode;
+
+    if (__fl_frame_projection_set) {
+        __fl_frame.projection = __fl_frame_projection;
+        __fl_frame.projectionSet = true;
+        __fl_frame_projection_set = false;
+    }
+
+    __fl_frame.pending = true;
+    FL_FRAME_SIGNAL();
+    FL_FRAME_UNLOCK();
 }
 
 /**
  * Here is where the actual drawing happens.
- * It sorts all the vertices and batches them based on the texture id
- * Each batch contains the offset in the vertices array that it starts from
- * as well as the number of vertices it holds.
+ * It sorts all the glyphs and batches them based on the texture id
+ * Each glyph is pushed as 4 vertices and drawn through a static index buffer,
+ * or as a single instance in the instanced mode.
+ * Each batch contains the glyph that it starts from,
+ * the number of glyphs it holds and up to textureUnits textures.
  * The next batch starts from where the last one ended
+ * The glyphs of every flRenderContext_t are merged in first.
+ * In the pipelined mode they are only handed over to flRendererSubmit.
  */
 FLAPI void flRendererEnd()
 {
     /*
-     * No glyphs were constructed. Nothing to do here
+     * Pull in everything the other contexts recorded
      */
-    if (__fl_glyphs_size == 0) return;
+    fl_renderer_merge_contexts();
 
-    FLASSERT(__fl_glyphs_size != 0);
+    if (__fl_config.pipelined) {
+        fl_renderer_hand_over();
+        return;
+    }
+
+    fl_renderer_flush(&__fl_context, __fl_sort_mode);
+    fl_renderer_end_frame(__fl_context.culled);
+}
+
+/**
+ * Draw the frame the last flRendererEnd handed over in the pipelined mode,
+ * waiting for it when there is none yet. Does nothing otherwise.
+ */
+FLAPI void flRendererSubmit()
+{
+    if (!__fl_config.pipelined) return;
 
+    FL_FRAME_LOCK();
+    while (!__fl_frame.pending) FL_FRAME_WAIT();
+    FL_FRAME_UNLOCK();
 
     /*
-     * Sort all the glyph by texture id
+     * The recording thread leaves the frame alone while it is pending
      */
-    qsort(__fl_glyphs, __fl_glyphs_size, FL_GLYPH_SIZE, fl_glyph_comparator);
+    if (__fl_frame.projectionSet) {
+        __fl_backend.setProjection(__fl_backend.user, &__fl_frame.projection);
+        __fl_frame.projectionSet = false;
+    }
 
+    fl_renderer_flush(&__fl_frame.context, __fl_frame.sortMode);
+    fl_renderer_end_frame(__fl_frame.context.culled);
+
+    FL_FRAME_LOCK();
+    __fl_frame.pending = false;
+    FL_FRAME_SIGNAL();
+    FL_FRAME_UNLOCK();
+}
+
+/*
+ * Sort, batch and draw the glyphs of a context.
+ * This is flRendererEnd without the merge, the mid-frame flush of
+ * flRendererDraw uses it since the other contexts may still be recording.
+ * flRendererSubmit uses it on the frame handed over.
+ */
+static void fl_renderer_flush(flRenderContext_t *context,
+        flSortMode_t sortMode)
+{
     /*
-     * We setup the first by hand
-     * We use a for loop for the rest of them
+     * No glyphs were constructed. Nothing to do here
      */
-    int crb = 0;
-    __fl_renderBatches[crb].offset = 0;
-    __fl_renderBatches[crb].numVertices = 6;
-    __fl_renderBatches[crb].texture = __fl_glyphs[0].texture;
+    if (context->size == 0) return;
+
+    FLASSERT(context->size != 0);
+
+    flSortKey_t *tmp;
+    unsigned char *data;
+    flRenderBatch_t *batches;
+    GLuint *batchTextures;
+    if (fl_flush_storage(context->size, context->capacity, &tmp, &data,
+            &batches, &batchTextures) != 0) {
+        FLASSERT(!"out of memory flushing the glyphs");
+        return;
+    }
 
     /*
-     * Use the sorted glyphs array to construct the vertices array
-     * that will be pushed to OpenGL
+     * Sort all the glyph by their keys.
+     * Without a sort mode the keys are already in submission order
      */
-    int offset = 0;
-    __fl_vertices[offset++] = __fl_glyphs[0].topLeft;
-    __fl_vertices[offset++] = __fl_glyphs[0].bottomLeft;
-    __fl_vertices[offset++] = __fl_glyphs[0].bottomRight;
-    __fl_vertices[offset++] = __fl_glyphs[0].bottomRight;
-    __fl_vertices[offset++] = __fl_glyphs[0].topRight;
-    __fl_vertices[offset++] = __fl_glyphs[0].topLeft;
+    double start = FL_TIME();
+    const flSortKey_t *keys = context->sortKeys;
+    if (sortMode != FL_SORT_NONE)
+        keys = fl_sort_keys(context->sortKeys, tmp, context->size);
+    double sorted = FL_TIME();
 
     /*
-     * First batch was created. Setup the rest.
-     * On each iteration we check the previous vertex what texture id it has
+     * In streaming mode the backend hands out the memory the glyph data
+     * goes to, where the GPU reads it from.
+     * Otherwise it goes to the staging copy and the backend uploads it
      */
-    int i;
-    for (i = 1; i < __fl_glyphs_size; i++) {
-        if (__fl_glyphs[i].texture != __fl_glyphs[i - 1].texture) {
-            /*
-             * Different texture id
-             * Setup a new render batch
-             */
-            crb++;
-            __fl_renderBatches[crb].offset = offset;
-            __fl_renderBatches[crb].numVertices = 6;
-            __fl_renderBatches[crb].texture = __fl_glyphs[i].texture;
-        }
-        else {
-            /*
-             * Same texture id
-             * Update the current render batch
-             */
-            __fl_renderBatches[crb].numVertices += 6;
-        }
-        __fl_vertices[offset++] = __fl_glyphs[i].topLeft;
-        __fl_vertices[offset++] = __fl_glyphs[i].bottomLeft;
-        __fl_vertices[offset++] = __fl_glyphs[i].bottomRight;
-        __fl_vertices[offset++] = __fl_glyphs[i].bottomRight;
-        __fl_vertices[offset++] = __fl_glyphs[i].topRight;
-        __fl_vertices[offset++] = __fl_glyphs[i].topLeft;
+    if (__fl_config.streamingFrames > 0) {
+        data = __fl_backend.map(__fl_backend.user, context->size);
+        FLASSERT(data != NULL);
+        if (data == NULL) return;
     }
+    double mapped = FL_TIME();
 
-    /*
-     * All render batches were created as well as the vertices array
-     */
-    glUseProgram(__fl_shader);
-    glBindVertexArray(__fl_vao);
-    glBindBuffer(GL_ARRAY_BUFFER, __fl_vbo);
+    int numBatches = fl_renderer_batch(context->glyphs, keys,
+        context->size, data, batches, batchTextures);
+    double expanded = FL_TIME();
+
+#ifndef NDEBUG
+    if (context->size > __fl_glyphs_highWater)
+        __fl_glyphs_highWater = context->size;
+    if (numBatches > __fl_renderBatches_highWater)
+        __fl_renderBatches_highWater = numBatches;
+#endif
 
     /*
-     * Orphan the buffer. Faster this way
+     * All render batches were created as well as the vertices array
      */
-    glBufferData(GL_ARRAY_BUFFER, FL_VERTEX_SIZE * offset, (const void *)0,
-        GL_DYNAMIC_DRAW);
-
-    glBufferSubData(GL_ARRAY_BUFFER, 0, FL_VERTEX_SIZE * offset, __fl_vertices);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    __fl_backend.draw(__fl_backend.user, data, context->size,
+        batches, numBatches, batchTextures);
 
     /*
-     * Iterate through the render batches and draw them
+     * Mapping the streaming region may wait on the GPU, that is
+     * counted as upload time
      */
-    for (i = 0; i < crb + 1; i++) {
-        glBindTexture(GL_TEXTURE_2D, __fl_renderBatches[i].texture);
-        glDrawArrays(GL_TRIANGLES, __fl_renderBatches[i].offset,
-                __fl_renderBatches[i].numVertices);
-    }
+    __fl_stats.sortTime += sorted - start;
+    __fl_stats.expandTime += expanded - mapped;
+    __fl_stats.uploadTime += (mapped - sorted) + (FL_TIME() - expanded);
+    __fl_stats.uploadedBytes += fl_glyph_data_size(context->size, batches,
+        numBatches);
+    __fl_stats.glyphs += context->size;
+    __fl_stats.batches += numBatches;
 }
 
 /**
  * Clean up code.
- * Delete the vertex array, the vertex buffer and the shader program
+ * Let the backend delete what it created and free the glyph storage
  */
 FLAPI void flRendererDestroy() {
-    glDeleteProgram(__fl_shader);
-    glDeleteVertexArrays(1, &__fl_vao);
-    glDeleteBuffers(1, &__fl_vbo);
+    if (__fl_backend_set) __fl_backend.destroy(__fl_backend.user);
+
+    free(__fl_context.glyphs);
+    free(__fl_context.sortKeys);
+    fl_flush_release();
+    free(__fl_frame.context.glyphs);
+    free(__fl_frame.context.sortKeys);
+    memset(&__fl_frame, 0, sizeof(__fl_frame));
+    __fl_frame_projection_set = false;
+    __fl_context.glyphs = NULL;
+    __fl_context.sortKeys = NULL;
+    __fl_context.size = 0;
+    __fl_context.capacity = 0;
+    __fl_context.culled = 0;
 }
 
 #endif /* FL_IMPLEMENTATION  */
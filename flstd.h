@@ -17,16 +17,38 @@
  * #include ...
  * #define FLSTD_IMPLEMENTATION
  * #include "flstd.h"
+ *
+ * On POSIX systems the implementation needs mmap, MAP_ANONYMOUS and
+ * posix_madvise, which strict -std=c99/c11 builds hide unless
+ * _DEFAULT_SOURCE or _POSIX_C_SOURCE is defined before the first system
+ * header. flstd.h and fl.h define them when they come first, so include
+ * one of them before anything else in that file, or define the macros on
+ * the command line. It stops with an #error when they came too late.
  */
 
 #ifndef __FLSTD_H__
 #define __FLSTD_H__
 
+/* mmap/madvise are POSIX, not ISO C; make -std=c99/c11 expose them. Only
+ * effective if this is the first include of the implementation file */
+#if (defined(FLSTD_IMPLEMENTATION) || defined(FL_IMPLEMENTATION)) && \
+	!defined(_WIN32)
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
+/* Shared with fl.h, whichever is included first defines it */
+#ifndef FLAPI
 #ifdef FL_STATIC
 #define FLAPI static
 #else
 #define FLAPI extern
 #endif
+#endif
 
 #ifdef __cplusplus
 #define FL_BEGIN_DECLS extern "C" {
@@ -36,12 +58,7 @@
 #define FL_END_DECLS
 #endif
 
-#ifndef __cplusplus
-typedef unsigned char		uint8_t;
-typedef unsigned short		uint16_t;
-typedef unsigned int		uint32_t;
-typedef unsigned long long	uint64_t;
-#endif 
+#include <stdint.h> /* uint8_t, uint16_t, uint32_t, uint64_t */
 typedef char * cstr_t;
 
 #define FL_TRUE  1
@@ -122,7 +139,10 @@ static void *(flstd__arraygrowfunc)(void *__arr, int __inc, int __sz)
 
 /*
  * Reads the file contents and returns the memory address of the allocated string
+ * or NULL when the file can not be read.
  * Remember to free the memory after done using the buffer
+ * For big files see flstd_file_map and flstd_file_stream_t, they do not copy
+ * the whole file.
  * Usage Example: 
  *		cstr_t buffer = flstd_file_read("myfile.txt");
  *		// do stuff with the contents
@@ -135,33 +155,1068 @@ FLAPI cstr_t flstd_file_read(const cstr_t __path);
  */
 FLAPI void flstd_file_free(void *__return_from_flstd_file_read);
 
+/*
+ * A read-only view of a whole file mapped in memory.
+ * The pages are read in by the OS as they are touched and shared with
+ * its file cache, nothing is copied. An empty file maps to NULL data.
+ * handle and mapping are only used on Windows.
+ * Usage Example:
+ *		flstd_file_map_t pack;
+ *		if (flstd_file_map(&pack, "assets.pak", FLSTD_MAP_SEQUENTIAL)) {
+ *			// read pack.data up to pack.size
+ *			flstd_file_unmap(&pack);
+ *		}
+ */
+typedef struct flstd_file_map {
+	const unsigned char *data;
+	size_t size;
+	void *handle;
+	void *mapping;
+} flstd_file_map_t;
+
+/* How the mapping is going to be read, so the OS can read ahead or not */
+#define FLSTD_MAP_NORMAL		0
+#define FLSTD_MAP_SEQUENTIAL	1
+#define FLSTD_MAP_RANDOM		2
+#define FLSTD_MAP_WILLNEED		4
+
+/*
+ * Map the file at __path with the FLSTD_MAP_ __hints ored together.
+ * FLSTD_MAP_WILLNEED starts reading the whole file in right away.
+ * Returns FL_FALSE when the file can not be opened or mapped
+ */
+FLAPI int flstd_file_map(flstd_file_map_t *__map, const char *__path, int __hints);
+
+/*
+ * Unmap a file mapped with flstd_file_map. The data is gone after it
+ */
+FLAPI void flstd_file_unmap(flstd_file_map_t *__map);
+
+/*
+ * Reads a file from start to end in chunks through a single buffer,
+ * for parsing files too big to keep around.
+ * data holds the size bytes of the current chunk. The buffer is either
+ * yours or malloc'd by flstd_file_stream_open, and can be kept for the next
+ * file by passing it to flstd_file_stream_open again.
+ * error is set when a read failed, the stream then ends.
+ * Usage Example:
+ *		flstd_file_stream_t stream;
+ *		size_t keep = 0;
+ *		flstd_file_stream_open(&stream, "level.txt", NULL, 0);
+ *		while (flstd_file_stream_next(&stream, keep)) {
+ *			// parse stream.data up to stream.size, keep tells how many
+ *			// bytes at the end were not parsed yet and are needed next time
+ *		}
+ *		flstd_file_stream_close(&stream);
+ */
+typedef struct flstd_file_stream {
+	FILE *fp;
+	unsigned char *data;
+	size_t size;
+	size_t capacity;
+	int owned;
+	int error;
+} flstd_file_stream_t;
+
+/* The buffer size flstd_file_stream_open allocates when given none */
+#ifndef FLSTD_STREAM_CHUNK
+#define FLSTD_STREAM_CHUNK (256 * 1024)
+#endif
+
+/*
+ * Open the file at __path for streaming through __buffer of __capacity bytes.
+ * With a NULL __buffer one of __capacity bytes, or FLSTD_STREAM_CHUNK when 0,
+ * is malloc'd and freed by flstd_file_stream_close.
+ * Returns FL_FALSE when the file can not be opened or the buffer allocated
+ */
+FLAPI int flstd_file_stream_open(flstd_file_stream_t *__stream, const char *__path, void *__buffer, size_t __capacity);
+
+/*
+ * Read the next chunk. The last __keep bytes of the current one are moved
+ * to the front of the buffer and the chunk read after them.
+ * __keep has to be less than the capacity of the buffer.
+ * Returns how many new bytes were read, 0 at the end of the file or on error
+ */
+FLAPI size_t flstd_file_stream_next(flstd_file_stream_t *__stream, size_t __keep);
+
+/*
+ * Close the file and free the buffer if flstd_file_stream_open allocated it
+ */
+FLAPI void flstd_file_stream_close(flstd_file_stream_t *__stream);
+
+/*
+/////////////////////////////////////////////////////////////////
+//	Asynchronous file loading
+*/
+
+/*
+ * Loads whole files on a pool of worker threads, pthreads or Windows ones,
+ * while the main thread keeps going. Every submitted path gets a handle
+ * back and, once it is loaded, failed or cancelled, exactly one result
+ * in the completion queue.
+ * The queue is drained with flstd_loader_poll, which never blocks,
+ * or flstd_loader_wait.
+ * Higher priorities are loaded first, equal ones in submission order.
+ * The data of a result is NUL terminated like flstd_file_read's and is
+ * yours to free with flstd_file_free.
+ * Usage Example:
+ *		flstd_loader_t *loader = flstd_loader_create(0);
+ *		const char *paths[] = { "sprite.vert", "sprite.frag" };
+ *		flstd_load_t handles[2];
+ *		flstd_loader_submit(loader, paths, 2, 10, NULL, handles);
+ *		// every frame
+ *		flstd_load_result_t result;
+ *		while (flstd_loader_poll(loader, &result)) {
+ *			if (result.status == FLSTD_LOAD_DONE)
+ *				flShaderAttach(program, result.data, ...);
+ *			flstd_file_free(result.data);
+ *		}
+ *		// when done
+ *		flstd_loader_destroy(loader);
+ */
+typedef struct flstd_loader flstd_loader_t;
+typedef int flstd_load_t;
+
+#define FLSTD_LOAD_DONE			0
+#define FLSTD_LOAD_FAILED		1
+#define FLSTD_LOAD_CANCELLED	2
+
+/* The worker threads flstd_loader_create starts when asked for 0 */
+#ifndef FLSTD_LOADER_THREADS
+#define FLSTD_LOADER_THREADS 2
+#endif
+
+/*
+ * What came of a load. data is NULL unless status is FLSTD_LOAD_DONE.
+ * user is the pointer given to flstd_loader_submit
+ */
+typedef struct flstd_load_result {
+	flstd_load_t handle;
+	int status;
+	cstr_t data;
+	size_t size;
+	void *user;
+} flstd_load_result_t;
+
+/*
+ * Start a loader with __threads worker threads, FLSTD_LOADER_THREADS when 0.
+ * Returns NULL when out of memory or the threads could not be started
+ */
+FLAPI flstd_loader_t *flstd_loader_create(int __threads);
+
+/*
+ * Queue __count paths to be loaded with __priority. The paths are copied.
+ * __users, if not NULL, holds a pointer per path handed back in its result.
+ * The handles are written to __handles, if not NULL.
+ * Returns FL_FALSE when out of memory, nothing is queued then
+ */
+FLAPI int flstd_loader_submit(flstd_loader_t *__loader, const char **__paths, int __count, int __priority, void **__users, flstd_load_t *__handles);
+
+/*
+ * Cancel a load. One still queued completes as FLSTD_LOAD_CANCELLED right
+ * away, one being read completes as FLSTD_LOAD_CANCELLED when the read is done.
+ * Returns FL_FALSE when it already completed
+ */
+FLAPI int flstd_loader_cancel(flstd_loader_t *__loader, flstd_load_t __handle);
+
+/*
+ * Take the oldest completed load out of the queue, without waiting.
+ * Returns FL_FALSE when there is none
+ */
+FLAPI int flstd_loader_poll(flstd_loader_t *__loader, flstd_load_result_t *__result);
+
+/*
+ * Take the oldest completed load out of the queue, waiting for one.
+ * Returns FL_FALSE when nothing is left to complete
+ */
+FLAPI int flstd_loader_wait(flstd_loader_t *__loader, flstd_load_result_t *__result);
+
+/*
+ * Stop the workers, after the reads in progress, and free everything.
+ * The loads still queued are dropped and so is the data of the results
+ * not taken out of the queue
+ */
+FLAPI void flstd_loader_destroy(flstd_loader_t *__loader);
+
+/*
+/////////////////////////////////////////////////////////////////
+//	Arena allocator
+*/
+
+/*
+ * A linear allocator. Every allocation is bumped off the end of a single
+ * block and nothing is freed on its own. Instead a marker taken earlier
+ * rolls back everything allocated after it, or the whole arena is reset,
+ * usually once per frame.
+ * The block is either memory you hand over, a malloc'd one or address
+ * space reserved up front and committed as the arena grows, so the
+ * allocations never move.
+ * Define FLSTD_ARENA_DEBUG before including this file to fill the memory
+ * given back by a rollback or a reset with FLSTD_ARENA_POISON.
+ * Usage Example:
+ *		flstd_arena_t frame;
+ *		flstd_arena_init_virtual(&frame, 256 << 20);
+ *		// every frame
+ *		float *scratch = flstd_arena_push(&frame, float, 1024);
+ *		flstd_arena_marker_t marker = flstd_arena_mark(&frame);
+ *		// temporaries
+ *		flstd_arena_rollback(&frame, marker);
+ *		flstd_arena_reset(&frame);
+ *		// when done
+ *		flstd_arena_free(&frame);
+ */
+typedef struct flstd_arena {
+	unsigned char *base;
+	size_t used;
+	size_t committed;
+	size_t reserved;
+	int kind;
+} flstd_arena_t;
+
+typedef size_t flstd_arena_marker_t;
+
+#define FLSTD_ARENA_BUFFER	0
+#define FLSTD_ARENA_HEAP	1
+#define FLSTD_ARENA_VIRTUAL	2
+
+/* The alignment of flstd_arena_push, enough for any type and SSE */
+#ifndef FLSTD_ARENA_ALIGN
+#define FLSTD_ARENA_ALIGN 16
+#endif
+
+/* How much a virtual arena commits at a time */
+#ifndef FLSTD_ARENA_COMMIT
+#define FLSTD_ARENA_COMMIT (64 * 1024)
+#endif
+
+#ifndef FLSTD_ARENA_POISON
+#define FLSTD_ARENA_POISON 0xDD
+#endif
+
+#define flstd_arena_push(a,type,n)	((type *)flstd_arena_alloc((a), sizeof(type) * (n), FLSTD_ARENA_ALIGN))
+
+/*
+ * Use __size bytes of your own memory. It is not freed by flstd_arena_free.
+ * Returns FL_TRUE
+ */
+FLAPI int flstd_arena_init_buffer(flstd_arena_t *__arena, void *__buffer, size_t __size);
+
+/*
+ * Malloc a block of __size bytes. The arena never grows past it.
+ * Returns FL_FALSE when out of memory
+ */
+FLAPI int flstd_arena_init(flstd_arena_t *__arena, size_t __size);
+
+/*
+ * Reserve __reserve bytes of address space without using any memory
+ * and commit it as the arena grows, FLSTD_ARENA_COMMIT bytes at a time.
+ * Returns FL_FALSE when the address space could not be reserved
+ */
+FLAPI int flstd_arena_init_virtual(flstd_arena_t *__arena, size_t __reserve);
+
+/*
+ * Allocate __size bytes aligned to __align, a power of two.
+ * Returns NULL when the arena is full. The memory is not cleared
+ */
+FLAPI void *flstd_arena_alloc(flstd_arena_t *__arena, size_t __size, size_t __align);
+
+/*
+ * Remember how much of the arena is allocated
+ */
+FLAPI flstd_arena_marker_t flstd_arena_mark(flstd_arena_t *__arena);
+
+/*
+ * Give back everything allocated after the marker was taken
+ */
+FLAPI void flstd_arena_rollback(flstd_arena_t *__arena, flstd_arena_marker_t __marker);
+
+/*
+ * Give back everything. The committed memory is kept for reuse
+ */
+FLAPI void flstd_arena_reset(flstd_arena_t *__arena);
+
+/*
+ * Free the block of the arena, unless it was handed over by flstd_arena_init_buffer
+ */
+FLAPI void flstd_arena_free(flstd_arena_t *__arena);
+
+/*
+ * flstd_arena_alloc with FLSTD_ARENA_ALIGN taking the arena as a void pointer,
+ * the signature fl.h wants for the renderer's scratch storage
+ * Usage Example:
+ *		flRendererScratch_t scratch = { &frame, flstd_arena_scratch };
+ *		flRendererSetScratch(&scratch);
+ */
+FLAPI void *flstd_arena_scratch(void *__arena, size_t __size);
+
 FL_END_DECLS
 #endif /* __FLSTD_H__ */
 
 #ifdef FLSTD_IMPLEMENTATION
 
-FLAPI cstr_t flstd_file_read(const cstr_t __path) {
-	long flstd__sz;
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h> /* VirtualAlloc, CreateFileMapping */
+#include <io.h> /* _get_osfhandle */
+#else
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <fcntl.h> /* open */
+#include <unistd.h> /* close */
+#include <pthread.h> /* pthread_create */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#if !defined(MAP_ANONYMOUS) && (defined(__unix__) || defined(__APPLE__))
+#error "flstd.h: mmap extensions are hidden, include flstd.h first or define _DEFAULT_SOURCE"
+#endif
+#endif
+
+/*
+ * Size of an open file, the way flstd_file_map gets it.
+ * ftell returns a long, 32 bits on Windows, and cuts off files past 2GB
+ */
+static int flstd__filesize(FILE *__fp, size_t *__size) {
+#ifdef _WIN32
+	LARGE_INTEGER flstd__size;
+	HANDLE flstd__file = (HANDLE)_get_osfhandle(_fileno(__fp));
+
+	if (flstd__file == INVALID_HANDLE_VALUE || !GetFileSizeEx(flstd__file, &flstd__size) || (unsigned long long)flstd__size.QuadPart >= (size_t)-1)
+		return FL_FALSE;
+	*__size = (size_t)flstd__size.QuadPart;
+#else
+	struct stat flstd__stat;
+
+	if (fstat(fileno(__fp), &flstd__stat) != 0 || flstd__stat.st_size < 0 || (unsigned long long)flstd__stat.st_size >= (size_t)-1)
+		return FL_FALSE;
+	*__size = (size_t)flstd__stat.st_size;
+#endif
+	return FL_TRUE;
+}
+
+/*
+ * flstd_file_read telling the size as well, for binary files
+ */
+static cstr_t flstd__fileread(const char *__path, size_t *__size) {
+	size_t flstd__sz, flstd__done, flstd__chunk;
 	cstr_t flstd__buffer;
 	FILE *flstd__fp;
 
 	flstd__fp = fopen(__path, "rb");
-	fseek(flstd__fp, 0, SEEK_END);
-	flstd__sz = ftell(flstd__fp);
-	fseek(flstd__fp, 0, SEEK_SET);
+	if (!flstd__fp)
+		return NULL;
+
+	if (!flstd__filesize(flstd__fp, &flstd__sz)) {
+		fclose(flstd__fp);
+		return NULL;
+	}
 	
 	flstd__buffer = (cstr_t) malloc(sizeof(char) * flstd__sz + 1);
+	if (!flstd__buffer) {
+		fclose(flstd__fp);
+		return NULL;
+	}
+
+	/* Some C runtimes fail single reads of 4GB and more, go 1GB at a time */
+	for (flstd__done = 0; flstd__done < flstd__sz; flstd__done += flstd__chunk) {
+		flstd__chunk = flstd__sz - flstd__done;
+		if (flstd__chunk > ((size_t)1 << 30))
+			flstd__chunk = (size_t)1 << 30;
+		if (fread(flstd__buffer + flstd__done, 1, flstd__chunk, flstd__fp) != flstd__chunk) {
+			free(flstd__buffer);
+			fclose(flstd__fp);
+			return NULL;
+		}
+	}
 	flstd__buffer[flstd__sz] = '\0';
-	fread(flstd__buffer, 1, flstd__sz, flstd__fp);
 	
 	fclose(flstd__fp);
+	*__size = flstd__sz;
 	return flstd__buffer;
 }
 
+FLAPI cstr_t flstd_file_read(const cstr_t __path) {
+	size_t flstd__size;
+	return flstd__fileread(__path, &flstd__size);
+}
+
 FLAPI  void flstd_file_free(void *__return_from_flstd_file_read) {
 	free(__return_from_flstd_file_read);
 }
 
+FLAPI int flstd_file_map(flstd_file_map_t *__map, const char *__path, int __hints) {
+	memset(__map, 0, sizeof(*__map));
+#ifdef _WIN32
+	{
+		DWORD flstd__flags = FILE_ATTRIBUTE_NORMAL;
+		LARGE_INTEGER flstd__size;
+		HANDLE flstd__file, flstd__mapping;
+
+		if (__hints & FLSTD_MAP_SEQUENTIAL)
+			flstd__flags |= FILE_FLAG_SEQUENTIAL_SCAN;
+		else if (__hints & FLSTD_MAP_RANDOM)
+			flstd__flags |= FILE_FLAG_RANDOM_ACCESS;
+
+		flstd__file = CreateFileA(__path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, flstd__flags, NULL);
+		if (flstd__file == INVALID_HANDLE_VALUE)
+			return FL_FALSE;
+		if (!GetFileSizeEx(flstd__file, &flstd__size) || (unsigned long long)flstd__size.QuadPart > (size_t)-1) {
+			CloseHandle(flstd__file);
+			return FL_FALSE;
+		}
+		if (flstd__size.QuadPart == 0) {
+			CloseHandle(flstd__file);
+			return FL_TRUE;
+		}
+
+		flstd__mapping = CreateFileMappingA(flstd__file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (flstd__mapping == NULL) {
+			CloseHandle(flstd__file);
+			return FL_FALSE;
+		}
+		__map->data = (const unsigned char *)MapViewOfFile(flstd__mapping, FILE_MAP_READ, 0, 0, 0);
+		if (__map->data == NULL) {
+			CloseHandle(flstd__mapping);
+			CloseHandle(flstd__file);
+			return FL_FALSE;
+		}
+
+		__map->size = (size_t)flstd__size.QuadPart;
+		__map->handle = flstd__file;
+		__map->mapping = flstd__mapping;
+	}
+#else
+	{
+		struct stat flstd__stat;
+		void *flstd__data;
+		int flstd__fd = open(__path, O_RDONLY);
+
+		if (flstd__fd < 0)
+			return FL_FALSE;
+		if (fstat(flstd__fd, &flstd__stat) != 0 || (unsigned long long)flstd__stat.st_size > (size_t)-1) {
+			close(flstd__fd);
+			return FL_FALSE;
+		}
+		if (flstd__stat.st_size == 0) {
+			close(flstd__fd);
+			return FL_TRUE;
+		}
+
+		/* The mapping keeps the file open on its own */
+		flstd__data = mmap(NULL, (size_t)flstd__stat.st_size, PROT_READ, MAP_PRIVATE, flstd__fd, 0);
+		close(flstd__fd);
+		if (flstd__data == MAP_FAILED)
+			return FL_FALSE;
+
+		__map->data = (const unsigned char *)flstd__data;
+		__map->size = (size_t)flstd__stat.st_size;
+
+#ifdef POSIX_MADV_NORMAL
+		if (__hints & FLSTD_MAP_SEQUENTIAL)
+			posix_madvise(flstd__data, __map->size, POSIX_MADV_SEQUENTIAL);
+		else if (__hints & FLSTD_MAP_RANDOM)
+			posix_madvise(flstd__data, __map->size, POSIX_MADV_RANDOM);
+		if (__hints & FLSTD_MAP_WILLNEED)
+			posix_madvise(flstd__data, __map->size, POSIX_MADV_WILLNEED);
+#else
+		(void)__hints;
+#endif
+	}
+#endif
+	return FL_TRUE;
+}
+
+FLAPI void flstd_file_unmap(flstd_file_map_t *__map) {
+#ifdef _WIN32
+	if (__map->data) {
+		UnmapViewOfFile(__map->data);
+		CloseHandle(__map->mapping);
+		CloseHandle(__map->handle);
+	}
+#else
+	if (__map->data)
+		munmap((void *)__map->data, __map->size);
+#endif
+	memset(__map, 0, sizeof(*__map));
+}
+
+FLAPI int flstd_file_stream_open(flstd_file_stream_t *__stream, const char *__path, void *__buffer, size_t __capacity) {
+	memset(__stream, 0, sizeof(*__stream));
+	if (!__buffer && !__capacity)
+		__capacity = FLSTD_STREAM_CHUNK;
+
+	__stream->fp = fopen(__path, "rb");
+	if (!__stream->fp)
+		return FL_FALSE;
+
+	/* The chunks are read straight into the buffer, stdio's own would copy them once more */
+	setvbuf(__stream->fp, NULL, _IONBF, 0);
+
+	__stream->data = (unsigned char *)__buffer;
+	__stream->capacity = __capacity;
+	if (!__buffer) {
+		__stream->data = (unsigned char *)malloc(__capacity);
+		__stream->owned = FL_TRUE;
+		if (!__stream->data) {
+			flstd_file_stream_close(__stream);
+			return FL_FALSE;
+		}
+	}
+	return FL_TRUE;
+}
+
+FLAPI size_t flstd_file_stream_next(flstd_file_stream_t *__stream, size_t __keep) {
+	size_t flstd__read;
+
+	if (!__stream->fp || __stream->error)
+		return 0;
+
+	FL_ASSERT(__keep <= __stream->size && __keep < __stream->capacity);
+	if (__keep > __stream->size)
+		__keep = __stream->size;
+	if (__keep >= __stream->capacity) {
+		__stream->error = FL_TRUE;
+		return 0;
+	}
+
+	memmove(__stream->data, __stream->data + __stream->size - __keep, __keep);
+	flstd__read = fread(__stream->data + __keep, 1, __stream->capacity - __keep, __stream->fp);
+	if (ferror(__stream->fp))
+		__stream->error = FL_TRUE;
+
+	__stream->size = __keep + flstd__read;
+	return flstd__read;
+}
+
+FLAPI void flstd_file_stream_close(flstd_file_stream_t *__stream) {
+	if (__stream->fp)
+		fclose(__stream->fp);
+	if (__stream->owned)
+		free(__stream->data);
+	memset(__stream, 0, sizeof(*__stream));
+}
+
+#ifdef _WIN32
+typedef HANDLE flstd__thread_t;
+typedef SRWLOCK flstd__mutex_t;
+typedef CONDITION_VARIABLE flstd__cond_t;
+#define flstd__mutexinit(m)		InitializeSRWLock(m)
+#define flstd__mutexfree(m)		((void)0)
+#define flstd__lock(m)			AcquireSRWLockExclusive(m)
+#define flstd__unlock(m)		ReleaseSRWLockExclusive(m)
+#define flstd__condinit(c)		InitializeConditionVariable(c)
+#define flstd__condfree(c)		((void)0)
+#define flstd__wait(c,m)		SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define flstd__signal(c)		WakeConditionVariable(c)
+#define flstd__broadcast(c)		WakeAllConditionVariable(c)
+#else
+typedef pthread_t flstd__thread_t;
+typedef pthread_mutex_t flstd__mutex_t;
+typedef pthread_cond_t flstd__cond_t;
+#define flstd__mutexinit(m)		pthread_mutex_init(m, NULL)
+#define flstd__mutexfree(m)		pthread_mutex_destroy(m)
+#define flstd__lock(m)			pthread_mutex_lock(m)
+#define flstd__unlock(m)		pthread_mutex_unlock(m)
+#define flstd__condinit(c)		pthread_cond_init(c, NULL)
+#define flstd__condfree(c)		pthread_cond_destroy(c)
+#define flstd__wait(c,m)		pthread_cond_wait(c, m)
+#define flstd__signal(c)		pthread_cond_signal(c)
+#define flstd__broadcast(c)		pthread_cond_broadcast(c)
+#endif
+
+/*
+ * A queued load. The queue is a binary heap on priority, then sequence
+ */
+typedef struct flstd__loadjob {
+	char *path;
+	int priority;
+	unsigned int sequence;
+	flstd_load_t handle;
+	void *user;
+} flstd__loadjob_t;
+
+/*
+ * There is a worker per thread.
+ * running holds the handle each worker is reading, -1 when idle,
+ * and cancelled whether it was cancelled since.
+ * The completed loads wait in results from results_head to results_count.
+ * pending counts the loads submitted and not taken out of the queue yet.
+ * Everything is guarded by lock, workers wait on work and the
+ * main thread on done.
+ */
+typedef struct flstd__loadworker {
+	flstd_loader_t *loader;
+	int index;
+	flstd__thread_t thread;
+} flstd__loadworker_t;
+
+struct flstd_loader {
+	flstd__mutex_t lock;
+	flstd__cond_t work;
+	flstd__cond_t done;
+	flstd__loadworker_t *workers;
+	int thread_count;
+	flstd_load_t *running;
+	int *cancelled;
+	flstd__loadjob_t *jobs;
+	int job_count;
+	int job_capacity;
+	flstd_load_result_t *results;
+	int results_head;
+	int results_count;
+	int results_capacity;
+	flstd_load_t next_handle;
+	unsigned int sequence;
+	int pending;
+	int quit;
+};
+
+/*
+ * Whether job __a is loaded before job __b
+ */
+static int flstd__jobbefore(const flstd__loadjob_t *__a, const flstd__loadjob_t *__b) {
+	if (__a->priority != __b->priority)
+		return __a->priority > __b->priority;
+	return (int)(__a->sequence - __b->sequence) < 0;
+}
+
+/*
+ * Move job __i up or down the heap to where it belongs
+ */
+static void flstd__jobsift(flstd_loader_t *__loader, int __i) {
+	flstd__loadjob_t *flstd__jobs = __loader->jobs;
+	flstd__loadjob_t flstd__job = flstd__jobs[__i];
+
+	while (__i > 0 && flstd__jobbefore(&flstd__job, &flstd__jobs[(__i - 1) / 2])) {
+		flstd__jobs[__i] = flstd__jobs[(__i - 1) / 2];
+		__i = (__i - 1) / 2;
+	}
+	for (;;) {
+		int flstd__child = 2 * __i + 1;
+		if (flstd__child >= __loader->job_count)
+			break;
+		if (flstd__child + 1 < __loader->job_count && flstd__jobbefore(&flstd__jobs[flstd__child + 1], &flstd__jobs[flstd__child]))
+			flstd__child++;
+		if (!flstd__jobbefore(&flstd__jobs[flstd__child], &flstd__job))
+			break;
+		flstd__jobs[__i] = flstd__jobs[flstd__child];
+		__i = flstd__child;
+	}
+	flstd__jobs[__i] = flstd__job;
+}
+
+/*
+ * Take job __i out of the heap
+ */
+static flstd__loadjob_t flstd__jobremove(flstd_loader_t *__loader, int __i) {
+	flstd__loadjob_t flstd__job = __loader->jobs[__i];
+	__loader->job_count--;
+	if (__i < __loader->job_count) {
+		__loader->jobs[__i] = __loader->jobs[__loader->job_count];
+		flstd__jobsift(__loader, __i);
+	}
+	return flstd__job;
+}
+
+/*
+ * Add a result to the completion queue, making room for it first.
+ * The queue always has room for every pending load, see flstd_loader_submit
+ */
+static void flstd__loadcomplete(flstd_loader_t *__loader, flstd_load_t __handle, int __status, cstr_t __data, size_t __size, void *__user) {
+	flstd_load_result_t *flstd__result;
+
+	if (__loader->results_head == __loader->results_count) {
+		__loader->results_head = 0;
+		__loader->results_count = 0;
+	}
+	else if (__loader->results_count == __loader->results_capacity) {
+		memmove(__loader->results, __loader->results + __loader->results_head,
+			sizeof(flstd_load_result_t) * (__loader->results_count - __loader->results_head));
+		__loader->results_count -= __loader->results_head;
+		__loader->results_head = 0;
+	}
+
+	flstd__result = &__loader->results[__loader->results_count++];
+	flstd__result->handle = __handle;
+	flstd__result->status = __status;
+	flstd__result->data = __data;
+	flstd__result->size = __size;
+	flstd__result->user = __user;
+	flstd__broadcast(&__loader->done);
+}
+
+static void flstd__loaderwork(flstd_loader_t *__loader, int __worker) {
+	flstd__lock(&__loader->lock);
+	for (;;) {
+		flstd__loadjob_t flstd__job;
+		cstr_t flstd__data;
+		size_t flstd__size = 0;
+
+		while (!__loader->quit && __loader->job_count == 0)
+			flstd__wait(&__loader->work, &__loader->lock);
+		if (__loader->quit)
+			break;
+
+		flstd__job = flstd__jobremove(__loader, 0);
+		__loader->running[__worker] = flstd__job.handle;
+		__loader->cancelled[__worker] = FL_FALSE;
+		flstd__unlock(&__loader->lock);
+
+		flstd__data = flstd__fileread(flstd__job.path, &flstd__size);
+		free(flstd__job.path);
+
+		flstd__lock(&__loader->lock);
+		__loader->running[__worker] = -1;
+		if (__loader->cancelled[__worker]) {
+			free(flstd__data);
+			flstd__loadcomplete(__loader, flstd__job.handle, FLSTD_LOAD_CANCELLED, NULL, 0, flstd__job.user);
+		}
+		else {
+			flstd__loadcomplete(__loader, flstd__job.handle, flstd__data ? FLSTD_LOAD_DONE : FLSTD_LOAD_FAILED,
+				flstd__data, flstd__size, flstd__job.user);
+		}
+	}
+	flstd__unlock(&__loader->lock);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI flstd__loaderthread(LPVOID __worker) {
+	flstd__loadworker_t *flstd__worker = (flstd__loadworker_t *)__worker;
+	flstd__loaderwork(flstd__worker->loader, flstd__worker->index);
+	return 0;
+}
+#else
+static void *flstd__loaderthread(void *__worker) {
+	flstd__loadworker_t *flstd__worker = (flstd__loadworker_t *)__worker;
+	flstd__loaderwork(flstd__worker->loader, flstd__worker->index);
+	return NULL;
+}
+#endif
+
+FLAPI flstd_loader_t *flstd_loader_create(int __threads) {
+	flstd_loader_t *flstd__loader;
+	int i;
+
+	if (__threads <= 0)
+		__threads = FLSTD_LOADER_THREADS;
+
+	flstd__loader = (flstd_loader_t *)calloc(1, sizeof(flstd_loader_t));
+	if (!flstd__loader)
+		return NULL;
+
+	flstd__mutexinit(&flstd__loader->lock);
+	flstd__condinit(&flstd__loader->work);
+	flstd__condinit(&flstd__loader->done);
+
+	flstd__loader->workers = (flstd__loadworker_t *)calloc(__threads, sizeof(flstd__loadworker_t));
+	flstd__loader->running = (flstd_load_t *)malloc(sizeof(flstd_load_t) * __threads);
+	flstd__loader->cancelled = (int *)calloc(__threads, sizeof(int));
+	if (!flstd__loader->workers || !flstd__loader->running || !flstd__loader->cancelled) {
+		flstd_loader_destroy(flstd__loader);
+		return NULL;
+	}
+
+	for (i = 0; i < __threads; i++) {
+		flstd__loadworker_t *flstd__worker = &flstd__loader->workers[i];
+		flstd__loader->running[i] = -1;
+		flstd__worker->loader = flstd__loader;
+		flstd__worker->index = i;
+#ifdef _WIN32
+		flstd__worker->thread = CreateThread(NULL, 0, flstd__loaderthread, flstd__worker, 0, NULL);
+		if (flstd__worker->thread == NULL)
+			break;
+#else
+		if (pthread_create(&flstd__worker->thread, NULL, flstd__loaderthread, flstd__worker) != 0)
+			break;
+#endif
+		flstd__loader->thread_count++;
+	}
+
+	if (flstd__loader->thread_count != __threads) {
+		flstd_loader_destroy(flstd__loader);
+		return NULL;
+	}
+	return flstd__loader;
+}
+
+FLAPI int flstd_loader_submit(flstd_loader_t *__loader, const char **__paths, int __count, int __priority, void **__users, flstd_load_t *__handles) {
+	char **flstd__paths;
+	int flstd__needed, i;
+
+	/* The workers read the paths long after this returns */
+	flstd__paths = (char **)malloc(sizeof(char *) * (__count > 0 ? __count : 1));
+	if (!flstd__paths)
+		return FL_FALSE;
+	for (i = 0; i < __count; i++) {
+		size_t flstd__length = strlen(__paths[i]) + 1;
+		flstd__paths[i] = (char *)malloc(flstd__length);
+		if (!flstd__paths[i])
+			break;
+		memcpy(flstd__paths[i], __paths[i], flstd__length);
+	}
+	if (i < __count) {
+		while (i-- > 0) free(flstd__paths[i]);
+		free(flstd__paths);
+		return FL_FALSE;
+	}
+
+	flstd__lock(&__loader->lock);
+
+	/*
+	 * Make room for the jobs and for their results up front,
+	 * so nothing can fail once the workers have them
+	 */
+	flstd__needed = __loader->job_count + __count;
+	if (flstd__needed > __loader->job_capacity) {
+		int flstd__capacity = __loader->job_capacity ? __loader->job_capacity << 1 : 16;
+		void *flstd__jobs;
+		while (flstd__capacity < flstd__needed) flstd__capacity <<= 1;
+		flstd__jobs = realloc(__loader->jobs, sizeof(flstd__loadjob_t) * flstd__capacity);
+		if (!flstd__jobs)
+			goto flstd__fail;
+		__loader->jobs = (flstd__loadjob_t *)flstd__jobs;
+		__loader->job_capacity = flstd__capacity;
+	}
+
+	flstd__needed = __loader->pending + __count;
+	if (flstd__needed > __loader->results_capacity) {
+		int flstd__capacity = __loader->results_capacity ? __loader->results_capacity << 1 : 16;
+		void *flstd__results;
+		while (flstd__capacity < flstd__needed) flstd__capacity <<= 1;
+		flstd__results = realloc(__loader->results, sizeof(flstd_load_result_t) * flstd__capacity);
+		if (!flstd__results)
+			goto flstd__fail;
+		__loader->results = (flstd_load_result_t *)flstd__results;
+		__loader->results_capacity = flstd__capacity;
+	}
+
+	for (i = 0; i < __count; i++) {
+		flstd__loadjob_t *flstd__job = &__loader->jobs[__loader->job_count++];
+		flstd__job->path = flstd__paths[i];
+		flstd__job->priority = __priority;
+		flstd__job->sequence = __loader->sequence++;
+		flstd__job->handle = __loader->next_handle++;
+		flstd__job->user = __users ? __users[i] : NULL;
+		if (__handles)
+			__handles[i] = flstd__job->handle;
+		flstd__jobsift(__loader, __loader->job_count - 1);
+	}
+
+	__loader->pending += __count;
+	flstd__broadcast(&__loader->work);
+	flstd__unlock(&__loader->lock);
+	free(flstd__paths);
+	return FL_TRUE;
+
+flstd__fail:
+	flstd__unlock(&__loader->lock);
+	for (i = 0; i < __count; i++) free(flstd__paths[i]);
+	free(flstd__paths);
+	return FL_FALSE;
+}
+
+FLAPI int flstd_loader_cancel(flstd_loader_t *__loader, flstd_load_t __handle) {
+	int flstd__found = FL_FALSE, i;
+
+	flstd__lock(&__loader->lock);
+	for (i = 0; i < __loader->job_count; i++) {
+		if (__loader->jobs[i].handle == __handle) {
+			flstd__loadjob_t flstd__job = flstd__jobremove(__loader, i);
+			free(flstd__job.path);
+			flstd__loadcomplete(__loader, __handle, FLSTD_LOAD_CANCELLED, NULL, 0, flstd__job.user);
+			flstd__found = FL_TRUE;
+			break;
+		}
+	}
+	for (i = 0; !flstd__found && i < __loader->thread_count; i++) {
+		if (__loader->running[i] == __handle) {
+			__loader->cancelled[i] = FL_TRUE;
+			flstd__found = FL_TRUE;
+		}
+	}
+	flstd__unlock(&__loader->lock);
+	return flstd__found;
+}
+
+/*
+ * Take the oldest result out of the queue, the lock held
+ */
+static int flstd__loadtake(flstd_loader_t *__loader, flstd_load_result_t *__result) {
+	if (__loader->results_head == __loader->results_count)
+		return FL_FALSE;
+	*__result = __loader->results[__loader->results_head++];
+	__loader->pending--;
+	return FL_TRUE;
+}
+
+FLAPI int flstd_loader_poll(flstd_loader_t *__loader, flstd_load_result_t *__result) {
+	int flstd__taken;
+	flstd__lock(&__loader->lock);
+	flstd__taken = flstd__loadtake(__loader, __result);
+	flstd__unlock(&__loader->lock);
+	return flstd__taken;
+}
+
+FLAPI int flstd_loader_wait(flstd_loader_t *__loader, flstd_load_result_t *__result) {
+	int flstd__taken;
+	flstd__lock(&__loader->lock);
+	while (!(flstd__taken = flstd__loadtake(__loader, __result)) && __loader->pending > 0)
+		flstd__wait(&__loader->done, &__loader->lock);
+	flstd__unlock(&__loader->lock);
+	return flstd__taken;
+}
+
+FLAPI void flstd_loader_destroy(flstd_loader_t *__loader) {
+	int i;
+
+	if (__loader->thread_count > 0) {
+		flstd__lock(&__loader->lock);
+		__loader->quit = FL_TRUE;
+		flstd__broadcast(&__loader->work);
+		flstd__unlock(&__loader->lock);
+	}
+	for (i = 0; i < __loader->thread_count; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(__loader->workers[i].thread, INFINITE);
+		CloseHandle(__loader->workers[i].thread);
+#else
+		pthread_join(__loader->workers[i].thread, NULL);
+#endif
+	}
+	flstd__condfree(&__loader->done);
+	flstd__condfree(&__loader->work);
+	flstd__mutexfree(&__loader->lock);
+
+	for (i = 0; i < __loader->job_count; i++)
+		free(__loader->jobs[i].path);
+	for (i = __loader->results_head; i < __loader->results_count; i++)
+		free(__loader->results[i].data);
+	free(__loader->jobs);
+	free(__loader->results);
+	free(__loader->workers);
+	free(__loader->running);
+	free(__loader->cancelled);
+	free(__loader);
+}
+
+FLAPI int flstd_arena_init_buffer(flstd_arena_t *__arena, void *__buffer, size_t __size) {
+	__arena->base = (unsigned char *)__buffer;
+	__arena->used = 0;
+	__arena->committed = __size;
+	__arena->reserved = __size;
+	__arena->kind = FLSTD_ARENA_BUFFER;
+	return FL_TRUE;
+}
+
+FLAPI int flstd_arena_init(flstd_arena_t *__arena, size_t __size) {
+	void *flstd__block = malloc(__size);
+	flstd_arena_init_buffer(__arena, flstd__block, flstd__block ? __size : 0);
+	__arena->kind = FLSTD_ARENA_HEAP;
+	return flstd__block ? FL_TRUE : FL_FALSE;
+}
+
+FLAPI int flstd_arena_init_virtual(flstd_arena_t *__arena, size_t __reserve) {
+	void *flstd__block;
+
+	/* Whole commit chunks, so every commit is page aligned */
+	__reserve = (__reserve + FLSTD_ARENA_COMMIT - 1) / FLSTD_ARENA_COMMIT * FLSTD_ARENA_COMMIT;
+#ifdef _WIN32
+	flstd__block = VirtualAlloc(NULL, __reserve, MEM_RESERVE, PAGE_NOACCESS);
+#elif defined(MAP_ANONYMOUS)
+	flstd__block = mmap(NULL, __reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (flstd__block == MAP_FAILED) flstd__block = NULL;
+#else
+	/* No anonymous mappings here, fall back to one up front heap block */
+	return flstd_arena_init(__arena, __reserve);
+#endif
+	flstd_arena_init_buffer(__arena, flstd__block, 0);
+	__arena->reserved = flstd__block ? __reserve : 0;
+	__arena->kind = FLSTD_ARENA_VIRTUAL;
+	return flstd__block ? FL_TRUE : FL_FALSE;
+}
+
+/*
+ * Make at least __needed bytes of a virtual arena usable
+ */
+static int flstd__arenacommit(flstd_arena_t *__arena, size_t __needed) {
+	size_t flstd__size;
+	unsigned char *flstd__start;
+
+	if (__arena->kind != FLSTD_ARENA_VIRTUAL || __needed > __arena->reserved)
+		return FL_FALSE;
+
+	flstd__size = (__needed - __arena->committed + FLSTD_ARENA_COMMIT - 1) / FLSTD_ARENA_COMMIT * FLSTD_ARENA_COMMIT;
+	if (flstd__size > __arena->reserved - __arena->committed)
+		flstd__size = __arena->reserved - __arena->committed;
+	flstd__start = __arena->base + __arena->committed;
+#ifdef _WIN32
+	if (VirtualAlloc(flstd__start, flstd__size, MEM_COMMIT, PAGE_READWRITE) == NULL)
+		return FL_FALSE;
+#else
+	if (mprotect(flstd__start, flstd__size, PROT_READ | PROT_WRITE) != 0)
+		return FL_FALSE;
+#endif
+	__arena->committed += flstd__size;
+	return FL_TRUE;
+}
+
+FLAPI void *flstd_arena_alloc(flstd_arena_t *__arena, size_t __size, size_t __align) {
+	size_t flstd__address, flstd__start, flstd__end;
+
+	FL_ASSERT(__align != 0 && (__align & (__align - 1)) == 0);
+
+	/* Align the address itself, the base is only as aligned as its block */
+	flstd__address = (size_t)(__arena->base + __arena->used);
+	flstd__start = __arena->used + ((__align - (flstd__address & (__align - 1))) & (__align - 1));
+	flstd__end = flstd__start + __size;
+	if (flstd__end < flstd__start)
+		return NULL;
+
+	if (flstd__end > __arena->committed && !flstd__arenacommit(__arena, flstd__end))
+		return NULL;
+
+	__arena->used = flstd__end;
+	return __arena->base + flstd__start;
+}
+
+FLAPI flstd_arena_marker_t flstd_arena_mark(flstd_arena_t *__arena) {
+	return __arena->used;
+}
+
+FLAPI void flstd_arena_rollback(flstd_arena_t *__arena, flstd_arena_marker_t __marker) {
+	FL_ASSERT(__marker <= __arena->used);
+	if (__marker > __arena->used)
+		return;
+#ifdef FLSTD_ARENA_DEBUG
+	memset(__arena->base + __marker, FLSTD_ARENA_POISON, __arena->used - __marker);
+#endif
+	__arena->used = __marker;
+}
+
+FLAPI void flstd_arena_reset(flstd_arena_t *__arena) {
+	flstd_arena_rollback(__arena, 0);
+}
+
+FLAPI void flstd_arena_free(flstd_arena_t *__arena) {
+	if (__arena->kind == FLSTD_ARENA_HEAP) {
+		free(__arena->base);
+	}
+	else if (__arena->kind == FLSTD_ARENA_VIRTUAL && __arena->base) {
+#ifdef _WIN32
+		VirtualFree(__arena->base, 0, MEM_RELEASE);
+#else
+		munmap(__arena->base, __arena->reserved);
+#endif
+	}
+	flstd_arena_init_buffer(__arena, NULL, 0);
+}
+
+FLAPI void *flstd_arena_scratch(void *__arena, size_t __size) {
+	return flstd_arena_alloc((flstd_arena_t *)__arena, __size, FLSTD_ARENA_ALIGN);
+}
+
 #endif
 
 /*
@@ -0,0 +1,60 @@
+/*
+ * headers.c - fl.h and flstd.h in the same file, as the arena scratch of
+ * flRendererSetScratch needs them. Built with FLSTD_FIRST and without,
+ * so both include orders are checked, under strict ISO C.
+ * Exits with 0 when the renderer drew a frame out of a virtual arena.
+ */
+
+#ifdef FLSTD_FIRST
+#define FLSTD_IMPLEMENTATION
+#include "../flstd.h"
+#endif
+
+#define FL_HEADLESS
+#define FL_IMPLEMENTATION
+#include "../fl.h"
+
+#ifndef FLSTD_FIRST
+#define FLSTD_IMPLEMENTATION
+#include "../flstd.h"
+#endif
+
+int main(void)
+{
+    flRendererRecording_t recording = { 0 };
+    flRendererBackend_t backend;
+    flstd_arena_t frame;
+    flVec4_t dest = { 0.0f, 0.0f, 32.0f, 32.0f };
+    flVec4_t src = { 0.0f, 0.0f, 1.0f, 1.0f };
+    int failed = 0;
+
+    if (!flstd_arena_init_virtual(&frame, 1 << 20) ||
+            frame.kind != FLSTD_ARENA_VIRTUAL) {
+        printf("FAIL: no virtual arena\n");
+        return 1;
+    }
+
+    flRendererScratch_t scratch = { &frame, flstd_arena_scratch };
+    flRendererNullBackend(&recording, &backend);
+    flRendererSetBackend(&backend);
+    flRendererInit();
+    flRendererSetScratch(&scratch);
+
+    flRendererBegin();
+    flRendererDraw(1, dest, src, 0xFFFFFFFF);
+    flRendererDraw(2, dest, src, 0xFFFFFFFF);
+    flRendererEnd();
+
+    if (recording.glyphs != 2 || frame.used == 0) {
+        printf("FAIL: %d glyphs, %d bytes of scratch\n",
+            (int)recording.glyphs, (int)frame.used);
+        failed = 1;
+    }
+
+    flRendererSetScratch(NULL);
+    flRendererDestroy();
+    flstd_arena_free(&frame);
+
+    if (!failed) printf("OK\n");
+    return failed;
+}